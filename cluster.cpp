@@ -0,0 +1,218 @@
+#include "tenuki.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <boost/asio.hpp>
+
+using std::string;
+using std::vector;
+using boost::asio::ip::tcp;
+
+/*
+ * クラスタ探索
+ * マスタがルートの手をワーカ（別プロセスのtenuki worker）に1手ずつ配り, ワーカは既存のalphabetaで探索して評価値と読み筋を返す.
+ * マスタはルートの手ごとに読み筋を覚えておき, 次の深さでその手を配るときに添える. ワーカはそれを置換表の手として入れてから読むので,
+ * 前の深さで別のワーカが読んだ手でも読み筋から先に読める. 置換表そのものは共有しない.
+ *
+ * プロトコル（1行1コマンド. 読み筋は<move>のあとの手をCSA形式で並べたもので, 無ければ省く）:
+ *   master -> worker: search <depth> <a> <b> <move> <sfen> <pv...>
+ *   worker -> master: score <score> <pv...>
+ *   master -> worker: quit
+ */
+
+namespace tenuki {
+
+    namespace {
+
+        struct connection {
+            tcp::socket socket;
+            boost::asio::streambuf buffer;
+            explicit connection(boost::asio::io_service& io_service) : socket(io_service) {}
+        };
+
+        void write_line(connection& c, const string& s) {
+            boost::asio::write(c.socket, boost::asio::buffer(s + "\n"));
+        }
+
+        const string read_line(connection& c) {
+            boost::asio::read_until(c.socket, c.buffer, "\n");
+            std::istream is(&c.buffer);
+            string line;
+            std::getline(is, line);
+            return line;
+        }
+
+        /**
+         * 手mを深さdepthで読ませ, 評価値を返す. pvは前の深さの読み筋を渡し, 今回の読み筋を受け取る
+         */
+        int request(connection& c, int depth, int a, int b, move_t m, const position& p, const string& sfen, string& pv) {
+            write_line(c, (boost::format("search %d %d %d %s %s%s%s") % depth % a % b % to_string(m, p) % sfen % (pv.empty() ? "" : " ") % pv).str());
+            const string line = read_line(c);
+            if (line.compare(0, 6, "score ") != 0) {
+                throw std::runtime_error("cluster: unexpected reply: " + line);
+            }
+            const size_t space = line.find(' ', 6);
+            if (space != string::npos) {
+                pv = line.substr(space + 1); // 窓の外で読み筋が無ければ前のを残す
+            }
+            return std::stoi(line.substr(6));
+        }
+
+        /**
+         * CSA形式の手を並べた読み筋をpから指せるところまで読む
+         */
+        const vector<move_t> parse_pv(vector<string>::const_iterator first, vector<string>::const_iterator last, position p) {
+            vector<move_t> pv;
+            for (auto it = first; it != last; ++it) {
+                const move_t m = parse_legal_move(*it, p);
+                if (m == 0) {
+                    break;
+                }
+                pv.push_back(m);
+                p = do_move(p, m);
+            }
+            return pv;
+        }
+    }
+
+
+    /**
+     * ワーカとしてportで待ち受ける. マスタとの接続が切れたら次の接続を待つ.
+     */
+    void run_worker(const string& port) {
+
+        searcher s;
+        boost::asio::io_service io_service;
+        tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), std::stoi(port)));
+        std::cerr << "worker: listening on port " << port << "\n";
+
+        for (;;) {
+            connection c(io_service);
+            acceptor.accept(c.socket);
+            try {
+                for (;;) {
+                    vector<string> v;
+                    const string line = read_line(c);
+                    boost::algorithm::split(v, line, boost::is_space());
+                    if (v.size() == 1 && v[0] == "quit") {
+                        break;
+                    }
+                    if (v.size() < 9 || v[0] != "search") {
+                        throw std::runtime_error("unexpected command: " + line);
+                    }
+                    const position p = parse_position(boost::algorithm::join(vector<string>(v.begin() + 5, v.begin() + 9), " "));
+                    const move_t m = parse_legal_move(v[4], p); // どこからでもつなげるので, 手も深さも確かめてから読む
+                    const int depth = std::stoi(v[1]);
+                    if (m == 0 || depth < 1 || depth > 32) {
+                        throw std::runtime_error("bad search request: " + line);
+                    }
+                    vector<move_t> pv;
+                    const int score = s.search_move(p, m, depth, std::stoi(v[2]), std::stoi(v[3]), parse_pv(v.begin() + 9, v.end(), do_move(p, m)), pv);
+                    string reply = "score " + std::to_string(score);
+                    position q = do_move(p, m);
+                    for (move_t n : pv) {
+                        reply += " " + to_string(n, q);
+                        q = do_move(q, n);
+                    }
+                    write_line(c, reply);
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "worker: " << e.what() << "\n";
+            }
+        }
+    }
+
+
+    /**
+     * workers（host:portのリスト）を使って深さdepthまで反復深化で探索し, 最善手を返す.
+     * 深さごとに, 前回の最善手を1台で探索して窓を作り, 残りの手を空いたワーカに1手ずつ配る.
+     */
+    move_t cluster_ponder(const position& p, int depth, const vector<string>& workers) {
+
+        boost::asio::io_service io_service;
+        tcp::resolver resolver(io_service);
+        vector<std::unique_ptr<connection>> connections;
+        for (const string& w : workers) {
+            const size_t colon = w.rfind(':');
+            if (colon == string::npos) {
+                throw std::runtime_error("cluster: host:port expected: " + w);
+            }
+            connections.push_back(std::make_unique<connection>(io_service));
+            boost::asio::connect(connections.back()->socket, resolver.resolve({w.substr(0, colon), w.substr(colon + 1)}));
+        }
+        if (connections.empty()) {
+            throw std::runtime_error("cluster: no workers");
+        }
+
+        move_t moves[593];
+        const int length = legal_moves(p, moves);
+        if (length == 0) {
+            return 0;
+        }
+
+        const string sfen = to_sfen(p);
+        const bool max_node = (p.side_to_move == side::BLACK);
+        const auto start = std::chrono::steady_clock::now();
+        move_t best = moves[0];
+        std::map<move_t, string> pvs; // ルートの手ごとの, ワーカが返した最新の読み筋
+
+        for (int d = 1; d <= depth; d++) {
+
+            // 前回の最善手を先に探索して窓を作る
+            std::swap(moves[0], *std::find(&moves[0], &moves[length], best));
+            int a = std::numeric_limits<int>::min();
+            int b = std::numeric_limits<int>::max();
+            (max_node ? a : b) = request(*connections[0], d, a, b, moves[0], p, sfen, pvs[moves[0]]);
+            best = moves[0];
+
+            // 残りの手を空いたワーカに配る
+            std::mutex mutex;
+            int next = 1;
+            string error;
+            vector<std::thread> threads;
+            for (auto& c : connections) {
+                threads.emplace_back([&, c = c.get()]() {
+                    try {
+                        for (;;) {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            if (next >= length || !error.empty()) {
+                                return;
+                            }
+                            const int i = next++;
+                            const int ca = a;
+                            const int cb = b;
+                            string pv = pvs[moves[i]];
+                            lock.unlock();
+                            const int score = request(*c, d, ca, cb, moves[i], p, sfen, pv);
+                            lock.lock();
+                            pvs[moves[i]] = pv;
+                            if (max_node ? score > a : score < b) {
+                                (max_node ? a : b) = score;
+                                best = moves[i];
+                            }
+                        }
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        error = e.what();
+                    }
+                });
+            }
+            for (std::thread& t : threads) {
+                t.join();
+            }
+            if (!error.empty()) {
+                throw std::runtime_error(error);
+            }
+
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cerr << d << ": " << to_string(best, p) << "(" << (max_node ? a : b) << ") " << pvs[best] << " " << elapsed << "s\n";
+        }
+
+        for (auto& c : connections) {
+            write_line(*c, "quit");
+        }
+        return best;
+    }
+}
@@ -0,0 +1,319 @@
+#include "tenuki.h"
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+namespace tenuki {
+
+    namespace {
+
+        /**
+         * CSA形式の駒名（2文字）を駒の種類にする. 駒名でなければtype::EMPTYを返す.
+         */
+        inline type_t parse_type(const char* s) {
+            switch (s[0] << 8 | s[1]) {
+            case 'F' << 8 | 'U': return type::PAWN;
+            case 'K' << 8 | 'Y': return type::LANCE;
+            case 'K' << 8 | 'E': return type::KNIGHT;
+            case 'G' << 8 | 'I': return type::SILVER;
+            case 'K' << 8 | 'A': return type::BISHOP;
+            case 'H' << 8 | 'I': return type::ROOK;
+            case 'K' << 8 | 'I': return type::GOLD;
+            case 'O' << 8 | 'U': return type::KING;
+            case 'T' << 8 | 'O': return type::PROMOTED_PAWN;
+            case 'N' << 8 | 'Y': return type::PROMOTED_LANCE;
+            case 'N' << 8 | 'K': return type::PROMOTED_KNIGHT;
+            case 'N' << 8 | 'G': return type::PROMOTED_SILVER;
+            case 'U' << 8 | 'M': return type::PROMOTED_BISHOP;
+            case 'R' << 8 | 'Y': return type::PROMOTED_ROOK;
+            default: return type::EMPTY;
+            }
+        }
+
+        inline bool is_digit(char c) {
+            return '0' <= c && c <= '9';
+        }
+
+        inline int parse_2digits(const char* s) {
+            return (s[0] - '0') * 10 + (s[1] - '0');
+        }
+
+        inline int parse_int(const char* s, const char* end) {
+            int n = 0;
+            for (; s < end && is_digit(*s); s++) {
+                n = n * 10 + (*s - '0');
+            }
+            return n;
+        }
+
+        [[noreturn]] void error(const char* s, const char* end) {
+            throw std::runtime_error("csa: " + string(s, end));
+        }
+
+        const position HIRATE = parse_position("lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1");
+
+        /**
+         * 1局分の読み込み状態
+         */
+        struct game_state {
+            position p;
+            bool started;   // 指し手が始まったか
+            bool finished;  // 終局したか（%TORYOなど）
+            move_t pending; // 消費時間待ちの指し手
+            int seconds;    // pendingの消費時間
+        };
+
+        void reset(game_state& g) {
+            g.p = HIRATE;
+            g.started = false;
+            g.finished = false;
+            g.pending = 0;
+            g.seconds = 0;
+        }
+
+        void flush(game_state& g, const csa_callback& f) {
+            if (g.pending != 0) {
+                f(g.p, g.pending, g.seconds);
+                g.p = do_move(g.p, g.pending);
+                g.pending = 0;
+                g.seconds = 0;
+            }
+        }
+
+        /**
+         * P+, P-: 駒を置く. 00は持ち駒, 00ALは残りの駒全部を持ち駒にする.
+         */
+        void put_pieces(position& p, const char* s, const char* end) {
+            static const int TOTAL[] = {18, 4, 4, 4, 2, 2, 4}; // 歩,香,桂,銀,角,飛,金
+            const side_t side = (s[1] == '+') ? side::BLACK : side::WHITE;
+            for (s += 2; s + 4 <= end; s += 4) {
+                if (s[2] == 'A' && s[3] == 'L') {
+                    int count[7] = {};
+                    for (int i = 11; i <= 99; i++) {
+                        if (p.squares[i] != square::EMPTY && p.squares[i] != square::WALL && square::type_of(p.squares[i]) != type::KING) {
+                            count[square::type_of(square::unpromote(p.squares[i]))]++;
+                        }
+                    }
+                    for (type_t t = type::PAWN; t <= type::GOLD; t++) {
+                        count[t] += p.pieces_in_hand[side::BLACK][t] + p.pieces_in_hand[side::WHITE][t];
+                        p.pieces_in_hand[side][t] += TOTAL[t] - count[t];
+                    }
+                    continue;
+                }
+                if (!is_digit(s[0]) || !is_digit(s[1])) {
+                    error(s, end);
+                }
+                const int to = parse_2digits(s);
+                const type_t t = parse_type(s + 2);
+                if (t == type::EMPTY || (to == 0 && t == type::KING) || (to != 0 && (file_of(to) == 0 || rank_of(to) == 0))) {
+                    error(s, end);
+                }
+                if (to == 0) {
+                    p.pieces_in_hand[side][square::type_of(square::unpromote(t))]++;
+                } else {
+                    p.squares[to] = (side == side::BLACK ? 0 : square::W) | t;
+                }
+            }
+        }
+
+        /**
+         * 1文（行をカンマで区切ったもの）を処理する
+         */
+        void parse_statement(game_state& g, const char* s, const char* end, const csa_callback& f) {
+
+            const int length = end - s;
+            if (length == 0 || g.finished) {
+                return;
+            }
+
+            switch (s[0]) {
+            case '+':
+            case '-':
+                if (length == 1) {
+                    g.p.side_to_move = (s[0] == '+') ? side::BLACK : side::WHITE; // 初期局面の手番
+                    return;
+                }
+                if (length < 7 || !is_digit(s[1]) || !is_digit(s[2]) || !is_digit(s[3]) || !is_digit(s[4])) {
+                    error(s, end);
+                }
+                if (!g.started) {
+                    rebuild(g.p);
+                    g.started = true;
+                }
+                flush(g, f);
+                {
+                    const int from = parse_2digits(s + 1);
+                    const int to = parse_2digits(s + 3);
+                    const type_t t = parse_type(s + 5);
+                    const side_t side = (s[0] == '+') ? side::BLACK : side::WHITE;
+                    if (t == type::EMPTY || side != g.p.side_to_move || file_of(to) == 0 || rank_of(to) == 0) {
+                        error(s, end);
+                    }
+                    if (from == 0 ? (t > type::GOLD || g.p.pieces_in_hand[side][t] == 0 || g.p.squares[to] != square::EMPTY)
+                                  : (file_of(from) == 0 || rank_of(from) == 0 || !square::is_friend(g.p.squares[from], side)
+                                     || square::type_of(square::unpromote(g.p.squares[from])) != square::type_of(square::unpromote(t))
+                                     || square::is_friend(g.p.squares[to], side))) {
+                        error(s, end); // 指せない手
+                    }
+                    if (from == 0) {
+                        g.pending = move::create_drop(t, to);
+                    } else if (t != square::type_of(g.p.squares[from])) {
+                        g.pending = move::create_promote(from, to);
+                    } else {
+                        g.pending = move::create(from, to);
+                    }
+                }
+                return;
+            case 'T':
+                g.seconds = parse_int(s + 1, end);
+                return;
+            case '%':
+                flush(g, f);
+                g.finished = true;
+                return;
+            case 'P':
+                if (length < 2) {
+                    error(s, end);
+                }
+                if (s[1] == 'I') {
+                    // 平手（後ろに落とす駒が続くことがある. 例：PI82HI22KA）
+                    g.p = HIRATE;
+                    for (const char* q = s + 2; q + 4 <= end; q += 4) {
+                        if (!is_digit(q[0]) || !is_digit(q[1]) || file_of(parse_2digits(q)) == 0 || rank_of(parse_2digits(q)) == 0) {
+                            error(s, end);
+                        }
+                        g.p.squares[parse_2digits(q)] = square::EMPTY;
+                    }
+                } else if (s[1] == '+' || s[1] == '-') {
+                    put_pieces(g.p, s, end);
+                } else if ('1' <= s[1] && s[1] <= '9') {
+                    // 一段ずつ. 例：P1-KY-KE-GI-KI-OU-KI-GI-KE-KY
+                    if (length < 2 + 27) {
+                        error(s, end);
+                    }
+                    const int rank = s[1] - '0';
+                    for (int file = 9; file >= 1; file--) {
+                        const char* c = s + 2 + (9 - file) * 3;
+                        const type_t t = parse_type(c + 1);
+                        g.p.squares[address(file, rank)] = (t == type::EMPTY) ? square::EMPTY : ((c[0] == '+' ? 0 : square::W) | t);
+                    }
+                }
+                return;
+            default:
+                return; // V, N, $, ' などは読み飛ばす
+            }
+        }
+    }
+
+
+    /**
+     * [begin, end)のCSA形式の棋譜を読み, 指し手ごとに f(指す前の局面, 指し手, 消費時間) を呼ぶ.
+     * "/" で区切られた複数の棋譜に対応する. 読んだ棋譜の数を返す.
+     */
+    int read_csa(const char* begin, const char* end, const csa_callback& f) {
+
+        game_state g;
+        reset(g);
+        int games = 0;
+
+        for (const char* line = begin; line < end; ) {
+            const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+            if (eol == nullptr) {
+                eol = end;
+            }
+            const char* last = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+
+            if (last - line == 1 && line[0] == '/') {
+                flush(g, f);
+                games += g.started;
+                reset(g);
+            } else if (line < last && line[0] != '\'') {
+                for (const char* s = line; s < last; ) {
+                    const char* comma = static_cast<const char*>(std::memchr(s, ',', last - s));
+                    const char* e = (comma == nullptr) ? last : comma;
+                    parse_statement(g, s, e, f);
+                    s = e + 1;
+                }
+            }
+            line = eol + 1;
+        }
+
+        flush(g, f);
+        return games + g.started;
+    }
+
+
+    /**
+     * CSA形式の棋譜ファイルをmmapして読む
+     */
+    int read_csa_file(const string& path, const csa_callback& f) {
+
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("csa: cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("csa: cannot mmap " + path);
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+        try {
+            const char* begin = static_cast<const char*>(addr);
+            const int games = read_csa(begin, begin + st.st_size, f);
+            munmap(addr, st.st_size);
+            return games;
+        } catch (...) {
+            munmap(addr, st.st_size);
+            throw;
+        }
+    }
+
+
+    /**
+     * ディレクトリ以下の*.csaをthreads本のスレッドで読む. 読んだ棋譜の数を返す.
+     * fは複数のスレッドから同時に呼ばれる. 読めなかったファイルはstd::cerrに出して飛ばす.
+     */
+    long read_csa_directory(const string& dir, int threads, const csa_callback& f) {
+
+        vector<string> paths;
+        for (boost::filesystem::recursive_directory_iterator it(dir), end; it != end; ++it) {
+            if (boost::filesystem::is_regular_file(it->status()) && it->path().extension() == ".csa") {
+                paths.push_back(it->path().string());
+            }
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<long> games(0);
+        vector<std::thread> workers;
+        for (int i = 0; i < std::max(threads, 1); i++) {
+            workers.emplace_back([&]() {
+                for (size_t j; (j = next++) < paths.size(); ) {
+                    try {
+                        games += read_csa_file(paths[j], f);
+                    } catch (const std::exception& e) {
+                        std::cerr << paths[j] << ": " << e.what() << "\n";
+                    }
+                }
+            });
+        }
+        for (std::thread& t : workers) {
+            t.join();
+        }
+        return games;
+    }
+}
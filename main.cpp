@@ -12,11 +12,13 @@ namespace {
     std::ofstream logfile;
 
     void write_line(tcp::socket& socket, const std::string& s) {
+        profile::scope scope(profile::IO);
         std::cout << ">" << s << "\n";
         boost::asio::write(socket, boost::asio::buffer(s + "\n"));
     }
 
     const std::string read_line(tcp::socket& socket) {
+        profile::scope scope(profile::IO);
         static boost::asio::streambuf b;
         boost::asio::read_until(socket, b, "\n");
         std::istream is(&b);
@@ -32,12 +34,146 @@ namespace {
         for (std::string s = read_line(socket); !std::regex_search(s, m, re); s = read_line(socket));
         return m;
     }
+
+    /**
+     * 決まった局面を決まった深さ・乱数の種で読み, 局面数の合計（シグネチャ）と速さを出す.
+     * 速くするだけの変更ならシグネチャは変わらないはず.
+     */
+    int bench(int depth) {
+
+        static const vector<string> SFENS {
+            "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+            "lnsgkgsnl/1r7/p1ppp1bpp/1p3pp2/7P1/2P6/PP1PPPP1P/1B3S1R1/LNSGKG1NL b - 9",
+            "l4S2l/4g1gs1/5p1p1/pr2N1pkp/4Gn3/PP3PPPP/2GPP4/1K7/L3r+s2L w BS2N5Pb 1",
+            "6n1l/2+S1k4/2lp4p/1np1B2b1/3PP4/1N1S3rP/1P2+pPP+p1/1p1G5/3KG2r1 b GSN2L4Pgs2p 1",
+            "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1",
+            "8l/1l+R2P3/p2pBG1pp/kps1p4/Nn1P2G2/P1P1P2PP/1PS6/1KSG3+r1/LN2+p3L w Sbgn3p 1",
+        };
+
+        searcher s(1);
+        search_limits limits;
+        limits.depth = depth;
+        limits.seed = 0;
+        limits.verbose = false;
+
+        uint64_t nodes = 0;
+        double seconds = 0;
+        for (const string& sfen : SFENS) {
+            const position p = parse_position(sfen);
+            s.clear();
+            s.set_position(p);
+            s.go(limits);
+            const search_result& r = s.wait();
+            std::cout << boost::format("%-10s %5d %12d  %s\n") % to_string(r.move, p) % r.score % r.nodes % sfen;
+            nodes += r.nodes;
+            seconds += r.seconds;
+        }
+        std::cout << "===========================\n";
+        std::cout << "depth     : " << depth << "\n";
+        std::cout << "nodes     : " << nodes << "\n";
+        std::cout << "time (ms) : " << (uint64_t)(seconds * 1000) << "\n";
+        std::cout << "nps       : " << (uint64_t)(nodes / seconds) << "\n";
+        return 0;
+    }
+
+    /**
+     * 対局のオプション
+     */
+    struct options {
+        int threads = std::max(1u, std::thread::hardware_concurrency());
+        int hash_mb = 16;
+        string shm_name;    // 置換表を同じ名前のほかのtenukiと共有する
+        bool huge_pages = false;
+        double seconds = 1.0; // 1手に使う時間
+        int games = 0;      // 複数対局モードで1アカウントが指す対局数. 0なら無制限
+    };
+
+    /**
+     * argv[first]以降のオプションを読む. 知らないオプションがあればfalseを返す
+     */
+    bool parse_options(int argc, char* argv[], int first, options& o) {
+        for (int i = first; i < argc; i++) {
+            const string opt = argv[i];
+            if (opt == "--huge-pages") {
+                o.huge_pages = true;
+            } else if (i + 1 < argc && opt == "--threads") {
+                o.threads = std::stoi(argv[++i]);
+            } else if (i + 1 < argc && opt == "--hash") {
+                o.hash_mb = std::stoi(argv[++i]);
+            } else if (i + 1 < argc && opt == "--shm") {
+                o.shm_name = argv[++i];
+            } else if (i + 1 < argc && opt == "--seconds") {
+                o.seconds = std::stod(argv[++i]);
+            } else if (i + 1 < argc && opt == "--games") {
+                o.games = std::stoi(argv[++i]);
+            } else {
+                std::cerr << "unknown option: " << opt << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
 }
 
 int main(int argc, char* argv[]) {
 
+    if (argc >= 5 && string(argv[1]) == "analyze") {
+        // 例：tenuki analyze 3 10 lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1
+        vector<string> sfen(argv + 4, argv + argc);
+        analyze(parse_position(boost::algorithm::join(sfen, " ")), std::stoi(argv[2]), std::stod(argv[3]));
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "bench") {
+        // 例：tenuki bench 5
+        return bench(argc >= 3 ? std::stoi(argv[2]) : 5);
+    }
+
+    if (argc == 3 && string(argv[1]) == "worker") {
+        // 例：tenuki worker 4091
+        run_worker(argv[2]);
+        return 0;
+    }
+
+    if (argc >= 8 && string(argv[1]) == "cluster") {
+        // 例：tenuki cluster 5 localhost:4091,localhost:4092 lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1
+        vector<string> workers;
+        boost::algorithm::split(workers, string(argv[3]), boost::is_any_of(","));
+        vector<string> sfen(argv + 4, argv + argc);
+        const position p = parse_position(boost::algorithm::join(sfen, " "));
+        std::cout << to_string(cluster_ponder(p, std::stoi(argv[2]), workers), p) << "\n";
+        return 0;
+    }
+
+    if (argc >= 5 && string(argv[1]) == "multi") {
+        // 例：tenuki multi localhost 4081 alice:pass,bob:pass --threads 4
+        options o;
+        if (!parse_options(argc, argv, 5, o)) {
+            return 1;
+        }
+        vector<string> v;
+        vector<std::pair<string, string>> accounts;
+        boost::algorithm::split(v, string(argv[4]), boost::is_any_of(","));
+        for (const string& a : v) {
+            const size_t colon = a.find(':');
+            if (colon == string::npos) {
+                std::cerr << "user:password expected: " << a << "\n";
+                return 1;
+            }
+            accounts.push_back(std::make_pair(a.substr(0, colon), a.substr(colon + 1)));
+        }
+        searcher s(o.threads, o.hash_mb, o.shm_name, o.huge_pages); // 全対局で共有する
+        run_multi(argv[2], argv[3], accounts, s, o.seconds, o.games);
+        return 0;
+    }
+
     if (argc < 5) {
-        std::cerr << "Usage: tenuki host port username password\n";
+        std::cerr << "Usage: tenuki host port username password [--threads n] [--hash mb] [--shm name] [--huge-pages] [--seconds s]\n";
+        std::cerr << "       tenuki multi host port user:password[,user:password...] [--threads n] [--hash mb] [--shm name] [--huge-pages] [--seconds s] [--games n]\n";
+        std::cerr << "       tenuki analyze multipv seconds sfen\n";
+        std::cerr << "       tenuki bench [depth]\n";
+        std::cerr << "       tenuki worker port\n";
+        std::cerr << "       tenuki cluster depth host:port[,host:port...] sfen\n";
         return 1;
     }
 
@@ -46,6 +182,11 @@ int main(int argc, char* argv[]) {
     const string USERNAME = argv[3];
     const string PASSWORD = argv[4];
 
+    options o;
+    if (!parse_options(argc, argv, 5, o)) {
+        return 1;
+    }
+
     logfile.open("tenuki.log");
 
     std::cout << "Connecting to " << HOST << " port " << PORT << ".\n";
@@ -63,10 +204,16 @@ int main(int argc, char* argv[]) {
     position p = parse_position("lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1");
     std::cerr << to_string(p) << "\n";
 
+    searcher s(o.threads, o.hash_mb, o.shm_name, o.huge_pages); // 対局中は置換表を持ち越す
+    search_limits limits;
+    limits.seconds = o.seconds;
+
     for (;;) {
 
         if (p.side_to_move == MYSIDE) {
-            write_line(socket, to_string(ponder(p), p));
+            s.set_position(p);
+            s.go(limits);
+            write_line(socket, to_string(s.wait().move, p));
         }
 
         move_t m;
@@ -76,8 +223,8 @@ int main(int argc, char* argv[]) {
                 if (line == "#LOSE" || line == "#WIN" || line == "#DRAW" || line == "#CENSORED") {
                     return 0;
                 }
-                m = parse_move(line, p);
-                retry = false;
+                m = parse_legal_move(line, p); // 合法手でない行はdo_moveに渡さない
+                retry = (m == 0);
             } catch (...) {
                 retry = true;
             }
@@ -2,7 +2,6 @@
 
 using std::map;
 using std::string;
-using std::vector;
 
 namespace tenuki {
 
@@ -75,75 +74,265 @@ namespace tenuki {
 
 
     /**
-     * do_move
+     * strの先頭のCSA形式の手（例：+7776FU）がpの合法手ならその手を, そうでなければ0を返す.
+     * parse_moveと違ってネットワークから来た行をそのままdo_moveに渡せる.
      */
-    const position do_move(position p, move_t m) {
-
-        assert(0 <= move::from(m) &&  move::from(m) <= 99);
-        assert(11 <= move::to(m) && move::to(m) <= 99);
-
-        if (move::is_drop(m)) {
-            assert(p.pieces_in_hand[p.side_to_move][move::from(m)] > 0);
-            p.squares[move::to(m)] = ((p.side_to_move == side::BLACK ? 0 : square::W) | move::from(m));
-            p.pieces_in_hand[p.side_to_move][move::from(m)]--;
-        } else {
-            // capture
-            if (p.squares[move::to(m)] != square::EMPTY) {
-                p.pieces_in_hand[p.side_to_move][square::type_of(square::unpromote(p.squares[move::to(m)]))]++;
+    move_t parse_legal_move(const std::string& str, const position& p) {
+        if (str.size() < 7) {
+            return 0;
+        }
+        const string csa = str.substr(0, 7);
+        move_t moves[593];
+        const int length = legal_moves(p, moves);
+        for (int i = 0; i < length; i++) {
+            if (to_string(moves[i], p) == csa) {
+                return moves[i];
             }
-            p.squares[move::to(m)] = move::is_promote(m) ? square::promote(p.squares[move::from(m)]) : p.squares[move::from(m)];
-            p.squares[move::from(m)] = square::EMPTY;
         }
-        p.side_to_move = (p.side_to_move == side::BLACK) ? side::WHITE : side::BLACK;
-        return p;
+        return 0;
     }
 
 
     namespace {
-        inline bool can_promote(square_t sq, int rank_to, int rank_from) {
-            if (square::type_of(sq) > type::ROOK) {
-                return false;
-            }
-            if (square::is_black(sq)) {
-                return rank_to <= 3 || rank_from <= 3;
-            } else {
-                return rank_to >= 7 || rank_from >= 7;
-            }
-        }
-
-        const static vector<vector<dir_t>> DIRECTIONS {
-            { dir::N },                                                                     //  0:PAWN
-            { dir::FN },                                                                    //  1:LANCE
-            { dir::NNE, dir::NNW },                                                         //  2:KNIGHT
-            { dir::N,   dir::NE,  dir::NW,  dir::SE,  dir::SW },                            //  3:SILVER
-            { dir::FNE, dir::FNW, dir::FSE, dir::FSW },                                     //  4:BISHOP
-            { dir::FN,  dir::FE,  dir::FW,  dir::FS },                                      //  5:ROOK
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S },                    //  6:GOLD
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S,  dir::SE, dir::SW }, //  7:KING
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S },                    //  8:PROMOTED_PAWN
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S },                    //  9:PROMOTED_LANCE
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S },                    // 10:PROMOTED_KNIGHT
-            { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S },                    // 11:PROMOTED_SILVER
-            { dir::FNE, dir::FNW, dir::FSE, dir::FSW, dir::N,  dir::E,  dir::W,  dir::S },  // 12:PROMOTED_BISHOP
-            { dir::FN,  dir::FE,  dir::FW,  dir::FS,  dir::NE, dir::NW, dir::SE, dir::SW }, // 13:PROMOTED_ROOK
+        /**
+         * 駒の動ける向き. DIRECTIONS[type_t]を範囲forで回す
+         */
+        struct directions {
+            int count;
+            dir_t d[8];
+            constexpr const dir_t* begin() const { return d; }
+            constexpr const dir_t* end() const { return d + count; }
+        };
+
+        constexpr directions DIRECTIONS[] {
+            {1, { dir::N }},                                                                     //  0:PAWN
+            {1, { dir::FN }},                                                                    //  1:LANCE
+            {2, { dir::NNE, dir::NNW }},                                                         //  2:KNIGHT
+            {5, { dir::N,   dir::NE,  dir::NW,  dir::SE,  dir::SW }},                            //  3:SILVER
+            {4, { dir::FNE, dir::FNW, dir::FSE, dir::FSW }},                                     //  4:BISHOP
+            {4, { dir::FN,  dir::FE,  dir::FW,  dir::FS }},                                      //  5:ROOK
+            {6, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S }},                    //  6:GOLD
+            {8, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S,  dir::SE, dir::SW }}, //  7:KING
+            {6, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S }},                    //  8:PROMOTED_PAWN
+            {6, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S }},                    //  9:PROMOTED_LANCE
+            {6, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S }},                    // 10:PROMOTED_KNIGHT
+            {6, { dir::N,   dir::NE,  dir::NW,  dir::E,   dir::W,  dir::S }},                    // 11:PROMOTED_SILVER
+            {8, { dir::FNE, dir::FNW, dir::FSE, dir::FSW, dir::N,  dir::E,  dir::W,  dir::S }},  // 12:PROMOTED_BISHOP
+            {8, { dir::FN,  dir::FE,  dir::FW,  dir::FS,  dir::NE, dir::NW, dir::SE, dir::SW }}, // 13:PROMOTED_ROOK
         };
 
-        const int RANK_MIN[] {
+        constexpr int RANK_MIN[] {
             // ▲歩,香,桂,銀,角,飛,金,王,と,成香,成桂,成銀,馬,龍,-,-,△歩,香,桂,銀,角,飛,金,王,と,成香,成桂,成銀,馬,龍
             2, 2, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
         };
 
-        const int RANK_MAX[] {
+        constexpr int RANK_MAX[] {
             // ▲歩,香,桂,銀,角,飛,金,王,と,成香,成桂,成銀,馬,龍,-,-,△歩,香,桂,銀,角,飛,金,王,と,成香,成桂,成銀,馬,龍
             9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 0, 0, 8, 8, 7, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
         };
+
+        constexpr uint8_t PROMOTE = 1; // 成る手を生成する
+        constexpr uint8_t NORMAL = 2;  // 成らない手を生成する
+
+        /**
+         * 盤上の駒sqがfromからtoへ動くとき生成する手（PROMOTE | NORMAL）
+         */
+        constexpr uint8_t promotions(square_t sq, int from, int to) {
+            const type_t t = square::type_of(sq);
+            const bool can_promote = t <= type::ROOK && (square::is_black(sq)
+                ? (rank_of(to) <= 3 || rank_of(from) <= 3)
+                : (rank_of(to) >= 7 || rank_of(from) >= 7));
+            if (can_promote) {
+                const bool unpromote = t == type::SILVER || ((rank_of(to) == 3 || rank_of(to) == 7) && (t == type::LANCE || t == type::KNIGHT)); // 銀か, 3段目,7段目の香,桂なら不成も生成する
+                return PROMOTE | (unpromote ? NORMAL : 0);
+            }
+            return (RANK_MIN[sq] <= rank_of(to) && rank_of(to) <= RANK_MAX[sq]) ? NORMAL : 0;
+        }
+
+        /**
+         * 盤上の駒の行き先の表. コンパイル時に作る
+         * at(sq, from)は駒sqがfromから行ける升を向きごとに近い順に並べたもの（盤外は除く）で, to == 0で終わる.
+         * 生成する手をflagsに引いてあり, 駒に当たったらskip（次の向きの先頭の添字）へ飛ぶ.
+         */
+        struct move_table {
+            struct step {
+                uint8_t to = 0;
+                uint8_t flags = 0;
+                uint8_t skip = 0;
+            };
+            step steps[30][100][24]; // 龍と馬でも20升 + 終わりの印
+
+            constexpr move_table() : steps() {
+                for (square_t sq = 0; sq < 30; sq++) {
+                    if (square::type_of(sq) > type::PROMOTED_ROOK) {
+                        continue;
+                    }
+                    for (int from = 11; from <= 99; from++) {
+                        if (!on_board(from)) {
+                            continue;
+                        }
+                        int length = 0;
+                        for (dir_t d : DIRECTIONS[square::type_of(sq)]) {
+                            const int v = (square::is_black(sq) ? dir::value(d) : -dir::value(d));
+                            const int first = length;
+                            for (int to = from + v; on_board(to); to += v) {
+                                steps[sq][from][length++] = {uint8_t(to), promotions(sq, from, to), 0};
+                                if (!dir::is_fly(d)) {
+                                    break;
+                                }
+                            }
+                            for (int i = first; i < length; i++) {
+                                steps[sq][from][i].skip = length;
+                            }
+                        }
+                    }
+                }
+            }
+
+            constexpr const step* at(square_t sq, int from) const { return steps[sq][from]; }
+
+            static constexpr bool on_board(int address) {
+                return 11 <= address && address <= 99 && address % 10 != 0;
+            }
+        };
+
+        constexpr move_table MOVES;
+
+        // 飛び利きの向き（盤上の絶対的な向き）. long_effectのbit番号はこの添字
+        const int RAY_DELTA[8] { -1, +1, -10, +10, -11, -9, +9, +11 };
+
+        // RAY_BIT[向き + 11]がRAY_DELTAの添字
+        const int8_t RAY_BIT[23] { 4, 2, 5, -1, -1, -1, -1, -1, -1, -1, 0, -1, 1, -1, -1, -1, -1, -1, -1, -1, 6, 3, 7 };
+
+        /**
+         * addressにある駒の利きを足す（sign = +1）か引く（sign = -1）
+         */
+        inline void update_piece_effect(position& p, int address, int sign) {
+            const square_t sq = p.squares[address];
+            const side_t s = square::is_black(sq) ? side::BLACK : side::WHITE;
+            for (dir_t d : DIRECTIONS[square::type_of(sq)]) {
+                const int v = (s == side::BLACK ? dir::value(d) : -dir::value(d));
+                if (!dir::is_fly(d)) {
+                    p.effect[s][address + v] += sign;
+                    continue;
+                }
+                const uint8_t bit = 1 << RAY_BIT[v + 11];
+                for (int to = address + v; ; to += v) {
+                    p.effect[s][to] += sign;
+                    p.long_effect[s][to] = (sign > 0) ? (p.long_effect[s][to] | bit) : (p.long_effect[s][to] & ~bit);
+                    if (p.squares[to] != square::EMPTY) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        /**
+         * addressを通る飛び利きを, addressの先の最初の駒まで伸ばす（sign = +1, addressが空いたとき）か
+         * 縮める（sign = -1, addressが埋まるとき）
+         */
+        inline void update_rays_through(position& p, int address, int sign) {
+            for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+                for (unsigned bits = p.long_effect[s][address]; bits != 0; bits &= bits - 1) {
+                    const int k = __builtin_ctz(bits);
+                    const int v = RAY_DELTA[k];
+                    for (int to = address + v; ; to += v) {
+                        p.effect[s][to] += sign;
+                        p.long_effect[s][to] = (sign > 0) ? (p.long_effect[s][to] | 1 << k) : (p.long_effect[s][to] & ~(1 << k));
+                        if (p.squares[to] != square::EMPTY) {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
     }
 
+
+    /**
+     * 利きを一から計算する
+     */
+    void compute_effects(position& p) {
+        std::fill(&p.effect[0][0], &p.effect[0][0] + sizeof(p.effect), 0);
+        std::fill(&p.long_effect[0][0], &p.long_effect[0][0] + sizeof(p.long_effect), 0);
+        for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+            for (int i = 0; i < p.piece_count[s]; i++) {
+                update_piece_effect(p, p.piece_list[s][i], +1);
+            }
+        }
+    }
+
+
+    /**
+     * do_move
+     */
+    template <side_t S>
+    const position do_move(position p, move_t m) {
+
+        profile::scope scope(profile::DO_MOVE);
+        assert(p.side_to_move == S);
+        assert(0 <= move::from(m) &&  move::from(m) <= 99);
+        assert(11 <= move::to(m) && move::to(m) <= 99);
+
+        constexpr side_t enemy = side::opponent(S);
+
+        if (move::is_drop(m)) {
+            assert(p.pieces_in_hand[S][move::from(m)] > 0);
+            update_rays_through(p, move::to(m), -1);
+            p.squares[move::to(m)] = ((S == side::BLACK ? 0 : square::W) | move::from(m));
+            p.pieces_in_hand[S][move::from(m)]--;
+            p.key += ZOBRIST.board[p.squares[move::to(m)]][move::to(m)] - ZOBRIST.hand[S][move::from(m)];
+            p.piece_index[move::to(m)] = p.piece_count[S];
+            p.piece_list[S][p.piece_count[S]++] = move::to(m);
+            update_piece_effect(p, move::to(m), +1);
+        } else {
+            const bool capture = (p.squares[move::to(m)] != square::EMPTY);
+            update_piece_effect(p, move::from(m), -1);
+            if (capture) {
+                update_piece_effect(p, move::to(m), -1);
+                p.pieces_in_hand[S][square::type_of(square::unpromote(p.squares[move::to(m)]))]++;
+                p.key += ZOBRIST.hand[S][square::type_of(square::unpromote(p.squares[move::to(m)]))] - ZOBRIST.board[p.squares[move::to(m)]][move::to(m)];
+                // 取られた駒を駒リストから外す（末尾の駒で穴を埋める）
+                const int last = p.piece_list[enemy][--p.piece_count[enemy]];
+                p.piece_list[enemy][p.piece_index[move::to(m)]] = last;
+                p.piece_index[last] = p.piece_index[move::to(m)];
+                if (square::type_of(p.squares[move::to(m)]) == type::KING) {
+                    p.king_address[enemy] = 0;
+                }
+            }
+            const square_t moved = move::is_promote(m) ? square::promote(p.squares[move::from(m)]) : p.squares[move::from(m)];
+            p.key += ZOBRIST.board[moved][move::to(m)] - ZOBRIST.board[p.squares[move::from(m)]][move::from(m)];
+            p.squares[move::from(m)] = square::EMPTY;
+            update_rays_through(p, move::from(m), +1);
+            if (!capture) {
+                update_rays_through(p, move::to(m), -1);
+            }
+            p.squares[move::to(m)] = moved;
+            update_piece_effect(p, move::to(m), +1);
+            p.piece_index[move::to(m)] = p.piece_index[move::from(m)];
+            p.piece_list[S][p.piece_index[move::to(m)]] = move::to(m);
+            if (square::type_of(p.squares[move::to(m)]) == type::KING) {
+                p.king_address[S] = move::to(m);
+            }
+        }
+        p.side_to_move = enemy;
+        p.key += (enemy == side::WHITE) ? 1 : -1;
+        return p;
+    }
+
+    const position do_move(position p, move_t m) {
+        return p.side_to_move == side::BLACK ? do_move<side::BLACK>(p, m) : do_move<side::WHITE>(p, m);
+    }
+
+
     /**
      * legal_moves
      */
+    template <side_t S>
     int legal_moves(const position& p, move_t* out_moves) {
 
+        profile::scope scope(profile::LEGAL_MOVES);
+        assert(p.side_to_move == S);
         if (p.pieces_in_hand[side::BLACK][type::KING] > 0 || p.pieces_in_hand[side::WHITE][type::KING] > 0) {
             return 0;
         }
@@ -151,30 +340,25 @@ namespace tenuki {
         bool fued[10] = {false, false, false, false, false, false, false, false, false, false}; // 0～9筋に味方の歩があるか
 
         // 駒を取る手を生成する
-        int length = capturel_moves(p, out_moves);
+        int length = capturel_moves<S>(p, out_moves);
 
         // 盤上の駒を動かす
-        for (int from = 11; from <= 99; from++) {
-            if (!square::is_friend(p.squares[from], p.side_to_move)) {
-                continue; // fromが味方の駒でなければcontinue
-            }
+        for (int i = 0; i < p.piece_count[S]; i++) {
+            const int from = p.piece_list[S][i];
             fued[file_of(from)] |= (square::type_of(p.squares[from]) == type::PAWN);
-            for (dir_t d : DIRECTIONS[square::type_of(p.squares[from])]) {
-                int v = (p.side_to_move == side::BLACK ? dir::value(d) : -dir::value(d));
-                for (int to = from + v; p.squares[to] == square::EMPTY; to += v) {
-                    if (can_promote(p.squares[from], rank_of(to), rank_of(from))) {
-                        out_moves[length++] = move::create_promote(from, to);
-                        if (square::type_of(p.squares[from]) == type::SILVER
-                            || ((rank_of(to) == 3 || rank_of(to) == 7) && (square::type_of(p.squares[from]) == type::LANCE || square::type_of(p.squares[from]) == type::KNIGHT))) {
-                            out_moves[length++] = move::create(from, to); // 銀か, 3段目,7段目の香,桂なら不成も生成する
-                        }
-                    } else if (RANK_MIN[p.squares[from]] <= rank_of(to) && rank_of(to) <= RANK_MAX[p.squares[from]]) {
-                        out_moves[length++] = move::create(from, to);
-                    }
-                    if (!dir::is_fly(d)) {
-                        break; // 飛び駒でなければここでbreak
-                    }
+            const move_table::step* const steps = MOVES.at(p.squares[from], from);
+            for (const move_table::step* s = steps; s->to != 0; ) {
+                if (p.squares[s->to] != square::EMPTY) {
+                    s = steps + s->skip; // 駒に当たったら次の向きへ
+                    continue;
+                }
+                if (s->flags & PROMOTE) {
+                    out_moves[length++] = move::create_promote(from, s->to);
                 }
+                if (s->flags & NORMAL) {
+                    out_moves[length++] = move::create(from, s->to);
+                }
+                s++;
             }
         }
 
@@ -184,7 +368,7 @@ namespace tenuki {
                 continue;
             }
             for (type_t t = (fued[file_of(to)] ? type::LANCE : type::PAWN); t <= type::GOLD; t++) { // 歩,香,桂,銀,角,飛,金
-                if (p.pieces_in_hand[p.side_to_move][t] > 0 && rank_of(to) >= RANK_MIN[p.side_to_move << 4 | t] && RANK_MAX[p.side_to_move << 4 | t] >= rank_of(to)) {
+                if (p.pieces_in_hand[S][t] > 0 && rank_of(to) >= RANK_MIN[S << 4 | t] && RANK_MAX[S << 4 | t] >= rank_of(to)) {
                     out_moves[length++] = move::create_drop(t, to);
                 }
             }
@@ -193,11 +377,19 @@ namespace tenuki {
         return length;
     }
 
+    int legal_moves(const position& p, move_t* out_moves) {
+        return p.side_to_move == side::BLACK ? legal_moves<side::BLACK>(p, out_moves) : legal_moves<side::WHITE>(p, out_moves);
+    }
+
+
     /**
      * capturel_moves
      */
+    template <side_t S>
     int capturel_moves(const position& p, move_t* out_moves) {
 
+        profile::scope scope(profile::CAPTURE_MOVES);
+        assert(p.side_to_move == S);
         if (p.pieces_in_hand[side::BLACK][type::KING] > 0 || p.pieces_in_hand[side::WHITE][type::KING] > 0) {
             return 0;
         }
@@ -205,32 +397,334 @@ namespace tenuki {
         int length = 0;
 
         // 盤上の駒を動かす
-        for (int from = 11; from <= 99; from++) {
-            if (!square::is_friend(p.squares[from], p.side_to_move)) {
-                continue; // fromが味方の駒でなければcontinue
-            }
-            for (dir_t d : DIRECTIONS[square::type_of(p.squares[from])]) {
-                int v = (p.side_to_move == side::BLACK ? dir::value(d) : -dir::value(d));
-                for (int to = from + v; p.squares[to] == square::EMPTY || square::is_enemy(p.squares[to], p.side_to_move);  to += v) {
-                    if (square::is_enemy(p.squares[to], p.side_to_move)) {
-                        if (can_promote(p.squares[from], rank_of(to), rank_of(from))) {
-                            out_moves[length++] = move::create_promote(from, to);
-                            if (square::type_of(p.squares[from]) == type::SILVER
-                                || ((rank_of(to) == 3 || rank_of(to) == 7) && (square::type_of(p.squares[from]) == type::LANCE || square::type_of(p.squares[from]) == type::KNIGHT))) {
-                                out_moves[length++] = move::create(from, to); // 銀か, 3段目,7段目の香,桂なら不成も生成する
-                            }
-                        } else if (RANK_MIN[p.squares[from]] <= rank_of(to) && rank_of(to) <= RANK_MAX[p.squares[from]]) {
-                            out_moves[length++] = move::create(from, to);
+        for (int i = 0; i < p.piece_count[S]; i++) {
+            const int from = p.piece_list[S][i];
+            const move_table::step* const steps = MOVES.at(p.squares[from], from);
+            for (const move_table::step* s = steps; s->to != 0; ) {
+                if (p.squares[s->to] == square::EMPTY) {
+                    s++;
+                    continue;
+                }
+                if (square::is_enemy(p.squares[s->to], S)) {
+                    if (s->flags & PROMOTE) {
+                        out_moves[length++] = move::create_promote(from, s->to);
+                    }
+                    if (s->flags & NORMAL) {
+                        out_moves[length++] = move::create(from, s->to);
+                    }
+                }
+                s = steps + s->skip; // 駒に当たったら次の向きへ
+            }
+        }
+
+        return length;
+    }
+
+    int capturel_moves(const position& p, move_t* out_moves) {
+        return p.side_to_move == side::BLACK ? capturel_moves<side::BLACK>(p, out_moves) : capturel_moves<side::WHITE>(p, out_moves);
+    }
+
+
+    namespace {
+        // 玉の周り8升
+        const int AROUND[8] { -11, -10, -9, -1, +1, +9, +10, +11 };
+
+        // 手番Sの桂がaddress + KNIGHT_FROM[S][i]にいればaddressに利く
+        const int KNIGHT_FROM[2][2] { { +12, -8 }, { -12, +8 } };
+
+        inline bool is_adjacent(int a, int b) {
+            return std::find(std::begin(AROUND), std::end(AROUND), a - b) != std::end(AROUND);
+        }
+
+        /**
+         * addressに利いている手番Sの駒のアドレスをout_fromに入れ, その数を返す
+         */
+        template <side_t S>
+        int attackers(const position& p, int address, int* out_from) {
+            int length = 0;
+            // 飛び利き: 逆向きにたどって最初の駒
+            for (unsigned bits = p.long_effect[S][address]; bits != 0; bits &= bits - 1) {
+                const int v = RAY_DELTA[__builtin_ctz(bits)];
+                int from = address - v;
+                while (p.squares[from] == square::EMPTY) {
+                    from -= v;
+                }
+                out_from[length++] = from;
+            }
+            // 飛ばない利き: 周り8升と桂の升
+            auto step = [&](int from) {
+                if (!square::is_friend(p.squares[from], S)) {
+                    return;
+                }
+                for (dir_t d : DIRECTIONS[square::type_of(p.squares[from])]) {
+                    if (!dir::is_fly(d) && from + (S == side::BLACK ? dir::value(d) : -dir::value(d)) == address) {
+                        out_from[length++] = from;
+                        return;
+                    }
+                }
+            };
+            for (int v : AROUND) {
+                step(address + v);
+            }
+            if (S == side::BLACK ? rank_of(address) <= 7 : rank_of(address) >= 3) {
+                step(address + KNIGHT_FROM[S][0]);
+                step(address + KNIGHT_FROM[S][1]);
+            }
+            assert(length == p.effect[S][address]);
+            return length;
+        }
+
+        /**
+         * 手番Oの駒がfromからtoへ動いても, 相手（手番S）の飛び駒に自玉kingを取られないか
+         */
+        template <side_t O>
+        bool can_move(const position& q, int from, int to, int king) {
+            constexpr side_t S = side::opponent(O);
+            for (unsigned bits = q.long_effect[S][from]; bits != 0; bits &= bits - 1) {
+                const int v = RAY_DELTA[__builtin_ctz(bits)];
+                int x = from + v;
+                while (q.squares[x] == square::EMPTY) {
+                    x += v;
+                }
+                if (x != king) {
+                    continue;
+                }
+                // ピンされている. ピンしている駒から玉までの線の上なら動ける
+                int pinner = from - v;
+                while (q.squares[pinner] == square::EMPTY) {
+                    pinner -= v;
+                }
+                for (int y = pinner; y != king; y += v) {
+                    if (y == to) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * 手番Oが玉以外の駒でtoへ動けるか（取る手・合駒）
+         */
+        template <side_t O>
+        bool can_reach(const position& q, int to, int king) {
+            int from[16];
+            const int n = attackers<O>(q, to, from);
+            for (int i = 0; i < n; i++) {
+                if (from[i] != king && can_move<O>(q, from[i], to, king)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * 手番Oがtoに合駒を打てるか
+         */
+        template <side_t O>
+        bool can_drop(const position& q, int to) {
+            for (type_t t = type::PAWN; t <= type::GOLD; t++) {
+                if (q.pieces_in_hand[O][t] == 0 || rank_of(to) < RANK_MIN[O << 4 | t] || RANK_MAX[O << 4 | t] < rank_of(to)) {
+                    continue;
+                }
+                if (t == type::PAWN) {
+                    bool fu = false; // 二歩
+                    for (int x = file_of(to) * 10 + 1; x <= file_of(to) * 10 + 9; x++) {
+                        fu |= (q.squares[x] == ((O == side::BLACK ? 0 : square::W) | type::PAWN));
+                    }
+                    if (fu) {
+                        continue;
+                    }
+                }
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * 手番Sがmを指して局面qになったとき, 相手が王手を受けられないか.
+         * 相手の駒を動かしたり打ったりできるかは利きと持ち駒とピンで判断する（打ち歩詰めなどの反則は考えない）.
+         */
+        template <side_t S>
+        bool no_evasion(const position& q, move_t m) {
+            constexpr side_t O = side::opponent(S);
+            const int king = q.king_address[O];
+
+            // 玉が逃げる. 玉の後ろの升には王手している飛び駒が利く
+            for (int v : AROUND) {
+                const int to = king + v;
+                if (q.squares[to] == square::WALL || square::is_friend(q.squares[to], O) || q.effect[S][to] > 0) {
+                    continue;
+                }
+                bool behind = false;
+                for (unsigned bits = q.long_effect[S][king]; bits != 0; bits &= bits - 1) {
+                    behind |= (to == king + RAY_DELTA[__builtin_ctz(bits)]);
+                }
+                if (!behind) {
+                    return false;
+                }
+            }
+            if (q.effect[S][king] >= 2) {
+                return true; // 両王手は玉が逃げるしかない
+            }
+
+            // 王手している駒を玉以外で取る
+            int checker = move::to(m);
+            int v = 0;
+            if (q.long_effect[S][king] != 0) {
+                v = RAY_DELTA[__builtin_ctz(q.long_effect[S][king])];
+                for (checker = king - v; q.squares[checker] == square::EMPTY; checker -= v);
+            }
+            if (q.effect[O][checker] > (is_adjacent(checker, king) ? 1 : 0) && can_reach<O>(q, checker, king)) {
+                return false;
+            }
+
+            // 合駒
+            if (v != 0) {
+                for (int to = king - v; to != checker; to -= v) {
+                    if (can_drop<O>(q, to) || (q.effect[O][to] > (is_adjacent(to, king) ? 1 : 0) && can_reach<O>(q, to, king))) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        /**
+         * mを指したら詰むか
+         */
+        template <side_t S>
+        inline bool is_mate(const position& p, move_t m) {
+            const position q = do_move<S>(p, m);
+            const int king = q.king_address[side::opponent(S)];
+            if (q.effect[S][king] == 0) {
+                return false; // 王手になっていない
+            }
+            if (q.king_address[S] != 0 && q.effect[side::opponent(S)][q.king_address[S]] > 0) {
+                return false; // 自玉が取られる
+            }
+            return no_evasion<S>(q, m);
+        }
+    }
+
+
+    /**
+     * 1手詰を探す. 詰ますには王手するしかないので, 王手になる手だけを調べる.
+     * 調べるのは持ち駒を打つ王手（打ち歩詰めは反則なので歩を除く）と, 玉の周り8升・桂の升へ盤上の駒を動かす王手.
+     * 離れたところから飛び駒を動かす王手と開き王手の詰みは見つけない（探索に任せる）.
+     * @return 詰ます手. なければ0
+     */
+    template <side_t S>
+    move_t mate_in_one(const position& p) {
+
+        profile::scope scope(profile::MATE_IN_ONE);
+        assert(p.side_to_move == S);
+        constexpr side_t O = side::opponent(S);
+        const int king = p.king_address[O];
+        if (king == 0 || p.pieces_in_hand[side::BLACK][type::KING] > 0 || p.pieces_in_hand[side::WHITE][type::KING] > 0) {
+            return 0;
+        }
+        if (p.effect[S][king] > 0) {
+            return 0; // 玉をそのまま取れる
+        }
+        const bool knight_check = (S == side::BLACK ? rank_of(king) <= 7 : rank_of(king) >= 3); // 桂で王手できる升が盤上にある
+
+        // 今の局面で玉が逃げられる升
+        int escapes[8];
+        int escape_count = 0;
+        for (int v : AROUND) {
+            if (p.squares[king + v] != square::WALL && !square::is_friend(p.squares[king + v], O) && p.effect[S][king + v] == 0) {
+                escapes[escape_count++] = king + v;
+            }
+        }
+
+        // 駒sqをfromからtoへ動かして（打つならfromは-1）も逃げられる升が残るならfalse. do_moveする前に大半の手をふるい落とす.
+        // fromを通る味方の飛び利きがあると, fromが空いて利きが増えるかもしれないので調べない
+        auto worth = [&](square_t sq, int from, int to) {
+            if (from >= 0 && p.long_effect[S][from] != 0) {
+                return true;
+            }
+            for (int i = 0; i < escape_count; i++) {
+                const int n = escapes[i];
+                bool covered = (n == to);
+                for (dir_t d : DIRECTIONS[square::type_of(sq)]) {
+                    const int v = (S == side::BLACK ? dir::value(d) : -dir::value(d));
+                    for (int x = to + v; !covered; x += v) {
+                        covered = (x == n);
+                        if (!dir::is_fly(d) || (p.squares[x] != square::EMPTY && x != from && x != king)) {
+                            break; // 玉は逃げた先にも飛び利きが通るので素通しにする
                         }
-                        break;
+                    }
+                }
+                if (!covered) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        // 持ち駒を打つ
+        for (type_t t = type::LANCE; t <= type::GOLD; t++) {
+            if (p.pieces_in_hand[S][t] == 0 || (t == type::KNIGHT && !knight_check)) {
+                continue;
+            }
+            for (dir_t d : DIRECTIONS[t]) {
+                const int v = (S == side::BLACK ? dir::value(d) : -dir::value(d));
+                for (int to = king - v; p.squares[to] == square::EMPTY; to -= v) {
+                    if (rank_of(to) >= RANK_MIN[S << 4 | t] && RANK_MAX[S << 4 | t] >= rank_of(to)
+                        && worth((S == side::BLACK ? 0 : square::W) | t, -1, to) && is_mate<S>(p, move::create_drop(t, to))) {
+                        return move::create_drop(t, to);
                     }
                     if (!dir::is_fly(d)) {
-                        break; // 飛び駒でなければここでbreak
+                        break;
                     }
                 }
             }
         }
 
-        return length;
+        // 盤上の駒を玉の周りに動かす
+        int targets[10];
+        int length = 0;
+        for (int v : AROUND) {
+            targets[length++] = king + v;
+        }
+        if (knight_check) {
+            targets[length++] = king + KNIGHT_FROM[S][0];
+            targets[length++] = king + KNIGHT_FROM[S][1];
+        }
+        for (int i = 0; i < length; i++) {
+            const int to = targets[i];
+            if (p.squares[to] == square::WALL || square::is_friend(p.squares[to], S) || p.effect[S][to] == 0) {
+                continue;
+            }
+            int from[16];
+            const int n = attackers<S>(p, to, from);
+            for (int j = 0; j < n; j++) {
+                const square_t sq = p.squares[from[j]];
+                const uint8_t flags = promotions(sq, from[j], to); // legal_movesと同じ条件
+                if ((flags & PROMOTE) && worth(square::promote(sq), from[j], to) && is_mate<S>(p, move::create_promote(from[j], to))) {
+                    return move::create_promote(from[j], to);
+                }
+                if ((flags & NORMAL) && worth(sq, from[j], to) && is_mate<S>(p, move::create(from[j], to))) {
+                    return move::create(from[j], to);
+                }
+            }
+        }
+        return 0;
+    }
+
+    move_t mate_in_one(const position& p) {
+        return p.side_to_move == side::BLACK ? mate_in_one<side::BLACK>(p) : mate_in_one<side::WHITE>(p);
     }
+
+
+    template const position do_move<side::BLACK>(position p, move_t m);
+    template const position do_move<side::WHITE>(position p, move_t m);
+    template int legal_moves<side::BLACK>(const position& p, move_t* out_moves);
+    template int legal_moves<side::WHITE>(const position& p, move_t* out_moves);
+    template int capturel_moves<side::BLACK>(const position& p, move_t* out_moves);
+    template int capturel_moves<side::WHITE>(const position& p, move_t* out_moves);
+    template move_t mate_in_one<side::BLACK>(const position& p);
+    template move_t mate_in_one<side::WHITE>(const position& p);
 }
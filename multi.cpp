@@ -0,0 +1,264 @@
+#include "tenuki.h"
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <boost/asio.hpp>
+
+using std::string;
+using std::vector;
+using boost::asio::ip::tcp;
+
+/*
+ * 複数対局モード
+ * 1つのasioのイベントループで複数のアカウントのCSAセッションを同時に扱い, 探索器（スレッドと置換表）は全対局で共有する.
+ *
+ * 探索器は一度に1局面しか読めないので, 手番の対局を待ち行列に並べて順に読む. どの対局も手番になってから
+ * seconds秒以内に指せるように, 読んでいる対局と待っている対局の全部から打ち切る時刻を決める（stop_time）.
+ * 待ち行列のi番目（読んでいる対局が0番目）の対局はi+1回分の探索を待つので, 残り時間を(i + 1)で割った分より
+ * 長くは読まない. 読んでいるあいだに対局が並んだら打ち切る時刻を決め直し, 早まればタイマでstop()する.
+ */
+
+namespace tenuki {
+
+    namespace {
+
+        using clock = std::chrono::steady_clock;
+
+        struct session;
+
+        /**
+         * 全セッションで共有する探索器の順番待ち
+         */
+        struct pool {
+            boost::asio::io_service& io_service;
+            searcher& s;
+            double seconds;
+            int games;                                    // 1セッションで指す対局数. 0なら無制限
+            std::deque<std::shared_ptr<session>> waiting; // 手番で探索を待っている対局
+            std::unique_ptr<boost::asio::io_service::work> searching; // 探索中はイベントループを終わらせない
+            session* current = nullptr;                   // 読んでいる対局
+            clock::time_point stop_at;                    // 読んでいる対局を打ち切る時刻
+            boost::asio::steady_timer timer;              // stop_atにstop()する
+            int serial = 0;                               // 何回目の探索か. 前の探索のタイマで止めないため
+            pool(boost::asio::io_service& io_service, searcher& s, double seconds, int games)
+                : io_service(io_service), s(s), seconds(seconds), games(games), timer(io_service) {}
+        };
+
+        struct session : std::enable_shared_from_this<session> {
+            pool& engine;
+            string user;
+            tcp::socket socket;
+            boost::asio::streambuf buffer;
+            std::deque<string> outbox; // 書き込み待ちの行（先頭が書き込み中）
+            side_t myside = side::BLACK;
+            bool playing = false;
+            position p;
+            int game = 0;   // 何局目か
+            int ply = 0;    // 何手目か. 探索しているあいだに局面が進んでいないか確かめる
+            int played = 0; // 終わった対局数
+            clock::time_point since; // 手番になった時刻
+            session(pool& engine, const string& user) : engine(engine), user(user), socket(engine.io_service) {}
+        };
+
+        void write_next(const std::shared_ptr<session>& s) {
+            boost::asio::async_write(s->socket, boost::asio::buffer(s->outbox.front()), [s](const boost::system::error_code& error, size_t) {
+                s->outbox.pop_front();
+                if (error) {
+                    s->outbox.clear();
+                    return;
+                }
+                if (!s->outbox.empty()) {
+                    write_next(s);
+                }
+            });
+        }
+
+        void write_line(const std::shared_ptr<session>& s, const string& line) {
+            std::cout << s->user << ">" << line << "\n";
+            s->outbox.push_back(line + "\n");
+            if (s->outbox.size() == 1) {
+                write_next(s); // 書き込み中なら, 書き終えたあとに続けて書かれる
+            }
+        }
+
+        bool on_move(const session* s) {
+            return s->playing && s->p.side_to_move == s->myside;
+        }
+
+        /**
+         * 読んでいる対局sを打ち切る時刻. sと待っている対局のどれもが手番になってからseconds秒以内に指せるようにする
+         */
+        clock::time_point stop_time(const pool& e, const session* s) {
+            const auto now = clock::now();
+            const auto limit = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(e.seconds));
+            clock::time_point t = s->since + limit;
+            int i = 1;
+            for (const auto& w : e.waiting) {
+                if (on_move(w.get())) {
+                    t = std::min(t, now + (w->since + limit - now) / ++i); // i番目の対局の前にi回読む
+                }
+            }
+            return std::max(t, now);
+        }
+
+        /**
+         * 打ち切る時刻をtまで早める
+         */
+        void shorten(pool& e, clock::time_point t) {
+            if (t >= e.stop_at) {
+                return;
+            }
+            e.stop_at = t;
+            e.timer.expires_at(t);
+            const int serial = e.serial;
+            e.timer.async_wait([&e, serial](const boost::system::error_code& error) {
+                if (!error && e.searching && e.serial == serial) {
+                    e.s.stop();
+                }
+            });
+        }
+
+        /**
+         * 待っている対局があり探索器が空いていれば, 先頭の対局を読み始める
+         */
+        void dispatch(pool& e) {
+            while (!e.searching && !e.waiting.empty()) {
+                session* s = e.waiting.front().get(); // セッションはrun_multiが持ち続ける
+                e.waiting.pop_front();
+                if (!on_move(s)) {
+                    continue; // 並んでいるあいだに対局が終わった
+                }
+                const clock::time_point t = stop_time(e, s);
+                search_limits limits;
+                limits.seconds = std::chrono::duration<double>(t - clock::now()).count();
+                limits.hard_seconds = std::max(limits.seconds, 0.001); // 0は制限なしなので, 時間が無くても少しは読む
+                limits.verbose = false;
+                const int game = s->game;
+                const int ply = s->ply;
+                limits.on_done = [&e, s, game, ply](const search_result& r) {
+                    e.io_service.post([&e, s, game, ply, r]() {
+                        e.searching.reset();
+                        e.current = nullptr;
+                        e.timer.cancel();
+                        if (s->playing && s->game == game && s->ply == ply) {
+                            write_line(s->shared_from_this(), r.move == 0 ? "%TORYO" : to_string(r.move, s->p));
+                        }
+                        dispatch(e);
+                    });
+                };
+                e.searching.reset(new boost::asio::io_service::work(e.io_service));
+                e.current = s;
+                e.serial++;
+                e.stop_at = clock::time_point::max();
+                shorten(e, t); // hard_secondsと同じ時刻. 後で早まったら決め直す
+                e.s.set_position(s->p);
+                e.s.go(limits);
+            }
+        }
+
+        /**
+         * 手番なら探索を頼む
+         */
+        void request(const std::shared_ptr<session>& s) {
+            if (s->p.side_to_move == s->myside) {
+                s->since = clock::now();
+                s->engine.waiting.push_back(s);
+                if (s->engine.searching) {
+                    shorten(s->engine, stop_time(s->engine, s->engine.current)); // 読んでいる対局は早めに切り上げる
+                }
+                dispatch(s->engine);
+            }
+        }
+
+        void on_line(const std::shared_ptr<session>& s, const string& line) {
+            std::cerr << s->user << "<" << line << "\n";
+            if (line.compare(0, 10, "Your_Turn:") == 0) {
+                s->myside = (line.substr(10, 1) == "+") ? side::BLACK : side::WHITE;
+            } else if (line == "END Game_Summary") {
+                write_line(s, "AGREE");
+            } else if (line.compare(0, 6, "START:") == 0) {
+                s->p = parse_position("lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1");
+                s->playing = true;
+                s->game++;
+                s->ply = 0;
+                request(s);
+            } else if (s->playing && line.size() >= 7 && (line[0] == '+' || line[0] == '-') && std::isdigit(line[1])) {
+                const move_t m = parse_legal_move(line, s->p);
+                if (m == 0) {
+                    // 局面が食い違っている（平手以外の初期局面など）. この対局は続けられないので切る
+                    std::cerr << s->user << ": unexpected move " << line << "\n";
+                    s->playing = false;
+                    if (s->engine.current == s.get()) {
+                        s->engine.s.stop();
+                    }
+                    s->socket.close();
+                    return;
+                }
+                s->p = do_move(s->p, m); // 自分の手も相手の手もサーバから返ってきた行で進める
+                s->ply++;
+                request(s);
+            } else if (line == "#WIN" || line == "#LOSE" || line == "#DRAW" || line == "#CENSORED") {
+                s->playing = false;
+                if (s->engine.current == s.get()) {
+                    s->engine.s.stop(); // 終わった対局は読まない
+                }
+                if (++s->played == s->engine.games) {
+                    write_line(s, "LOGOUT");
+                }
+            } else if (line.compare(0, 7, "LOGOUT:") == 0 || (line.compare(0, 6, "LOGIN:") == 0 && line.find(" OK") == string::npos)) {
+                s->socket.close();
+            }
+        }
+
+        void read_next(const std::shared_ptr<session>& s) {
+            boost::asio::async_read_until(s->socket, s->buffer, "\n", [s](const boost::system::error_code& error, size_t) {
+                if (error) {
+                    s->playing = false;
+                    if (error != boost::asio::error::eof && error != boost::asio::error::operation_aborted) {
+                        std::cerr << s->user << ": " << error.message() << "\n";
+                    }
+                    return;
+                }
+                std::istream is(&s->buffer);
+                string line;
+                std::getline(is, line);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                try {
+                    on_line(s, line);
+                } catch (const std::exception& e) {
+                    std::cerr << s->user << ": " << e.what() << "\n";
+                }
+                if (s->socket.is_open()) {
+                    read_next(s);
+                }
+            });
+        }
+    }
+
+
+    /**
+     * host:portのCSAサーバにaccounts（ユーザ名とパスワードの組）で同時にログインし, 全員の対局をsで指す.
+     * 1手の持ち時間はseconds秒. 各アカウントはgames局指したらログアウトする（0なら切断されるまで続ける）.
+     * 全セッションが切れたら返る.
+     */
+    void run_multi(const string& host, const string& port, const vector<std::pair<string, string>>& accounts, searcher& s, double seconds, int games) {
+
+        boost::asio::io_service io_service;
+        pool e(io_service, s, seconds, games);
+        vector<std::shared_ptr<session>> sessions; // io_serviceより先に消す
+        tcp::resolver resolver(io_service);
+        const auto endpoints = resolver.resolve({host, port});
+
+        for (const auto& account : accounts) {
+            sessions.push_back(std::make_shared<session>(e, account.first));
+            boost::asio::connect(sessions.back()->socket, endpoints);
+            write_line(sessions.back(), "LOGIN " + account.first + " " + account.second);
+            read_next(sessions.back());
+        }
+        io_service.run();
+        s.wait();
+    }
+}
@@ -0,0 +1,199 @@
+#include "tenuki.h"
+
+namespace tenuki {
+
+    namespace {
+
+        struct code_t {
+            int value; // 下位bitから書く
+            int bits;
+        };
+
+        // 盤上の駒の符号. この後ろに成りフラグ(金以外), 先後フラグが続く.
+        // 歩,香,桂,銀,角,飛,金
+        const code_t BOARD_CODE[] {
+            {0b01, 2}, {0b0011, 4}, {0b1011, 4}, {0b0111, 4}, {0b011111, 6}, {0b111111, 6}, {0b01111, 5},
+        };
+
+        const code_t EMPTY_CODE {0b0, 1};
+
+        // 持ち駒の符号. 盤上の符号から先頭の1bitを削ったもの. この後ろに成りフラグ(金以外, 常に0), 先後フラグが続く.
+        // 持ち駒1枚と空き升1つの合計が盤上の駒1枚と同じbit数になるので, 駒が40枚揃っていれば常に256bitになる.
+        // 歩,香,桂,銀,角,飛,金
+        const code_t HAND_CODE[] {
+            {0b0, 1}, {0b001, 3}, {0b101, 3}, {0b011, 3}, {0b01111, 5}, {0b11111, 5}, {0b0111, 4},
+        };
+
+        constexpr int BITS = 256;
+
+        inline void write_bits(uint8_t* data, int& pos, int value, int bits) {
+            if (pos + bits > BITS) {
+                throw std::runtime_error("pack: too many pieces");
+            }
+            for (int i = 0; i < bits; i++, pos++) {
+                data[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+            }
+        }
+
+        inline int read_bits(const uint8_t* data, int& pos, int bits) {
+            if (pos + bits > BITS) {
+                throw std::runtime_error("unpack: broken data");
+            }
+            int value = 0;
+            for (int i = 0; i < bits; i++, pos++) {
+                value |= ((data[pos >> 3] >> (pos & 7)) & 1) << i;
+            }
+            return value;
+        }
+
+        /**
+         * codesの中から符号を1つ読んで駒の種類を返す
+         */
+        inline type_t read_code(const uint8_t* data, int& pos, const code_t* codes) {
+            int value = 0;
+            for (int bits = 1; bits <= 6; bits++) {
+                value |= read_bits(data, pos, 1) << (bits - 1);
+                for (type_t t = type::PAWN; t <= type::GOLD; t++) {
+                    if (codes[t].bits == bits && codes[t].value == value) {
+                        return t;
+                    }
+                }
+            }
+            throw std::runtime_error("unpack: broken data");
+        }
+
+        // 駒の種類ごとの枚数の上限. 歩,香,桂,銀,角,飛,金
+        const int PIECE_MAX[] { 18, 4, 4, 4, 2, 2, 4 };
+
+        // 玉の位置は (筋 - 1) * 9 + (段 - 1) の0～80で表す
+        inline int king_index(int address) {
+            return (file_of(address) - 1) * 9 + (rank_of(address) - 1);
+        }
+    }
+
+
+    /**
+     * 局面を256bitに詰める
+     * 両玉が盤上にあり, 駒が40枚揃っている局面でなければruntime_errorを投げる.
+     */
+    const packed_position pack(const position& p) {
+
+        if (p.king_address[side::BLACK] == 0 || p.king_address[side::WHITE] == 0) {
+            throw std::runtime_error("pack: king not found");
+        }
+
+        packed_position pp;
+        std::fill(std::begin(pp.data), std::end(pp.data), 0);
+        int pos = 0;
+
+        write_bits(pp.data, pos, p.side_to_move, 1);
+        write_bits(pp.data, pos, king_index(p.king_address[side::BLACK]), 7);
+        write_bits(pp.data, pos, king_index(p.king_address[side::WHITE]), 7);
+
+        // 盤上
+        for (int file = 1; file <= 9; file++) {
+            for (int rank = 1; rank <= 9; rank++) {
+                const square_t sq = p.squares[address(file, rank)];
+                if (sq == square::EMPTY) {
+                    write_bits(pp.data, pos, EMPTY_CODE.value, EMPTY_CODE.bits);
+                    continue;
+                }
+                const type_t t = square::type_of(square::unpromote(sq));
+                if (t == type::KING) {
+                    continue;
+                }
+                write_bits(pp.data, pos, BOARD_CODE[t].value, BOARD_CODE[t].bits);
+                if (t != type::GOLD) {
+                    write_bits(pp.data, pos, square::type_of(sq) != t, 1);
+                }
+                write_bits(pp.data, pos, square::is_white(sq), 1);
+            }
+        }
+
+        // 持ち駒
+        for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+            for (type_t t = type::PAWN; t <= type::GOLD; t++) {
+                for (int i = 0; i < p.pieces_in_hand[s][t]; i++) {
+                    write_bits(pp.data, pos, HAND_CODE[t].value, HAND_CODE[t].bits);
+                    if (t != type::GOLD) {
+                        write_bits(pp.data, pos, 0, 1);
+                    }
+                    write_bits(pp.data, pos, s, 1);
+                }
+            }
+        }
+
+        if (pos != BITS) {
+            throw std::runtime_error("pack: missing pieces");
+        }
+        return pp;
+    }
+
+
+    /**
+     * packの逆
+     */
+    const position unpack(const packed_position& pp) {
+
+        position p;
+        std::fill(std::begin(p.squares), std::end(p.squares), square::WALL);
+        std::fill(std::begin(p.pieces_in_hand[side::BLACK]), std::end(p.pieces_in_hand[side::BLACK]), 0);
+        std::fill(std::begin(p.pieces_in_hand[side::WHITE]), std::end(p.pieces_in_hand[side::WHITE]), 0);
+        int pos = 0;
+
+        p.side_to_move = read_bits(pp.data, pos, 1);
+        const int kings[2] = {read_bits(pp.data, pos, 7), read_bits(pp.data, pos, 7)};
+        if (kings[side::BLACK] > 80 || kings[side::WHITE] > 80 || kings[side::BLACK] == kings[side::WHITE]) {
+            throw std::runtime_error("unpack: broken data");
+        }
+
+        // 盤上
+        for (int file = 1; file <= 9; file++) {
+            for (int rank = 1; rank <= 9; rank++) {
+                const int i = (file - 1) * 9 + (rank - 1);
+                if (i == kings[side::BLACK]) {
+                    p.squares[address(file, rank)] = square::B_KING;
+                    continue;
+                }
+                if (i == kings[side::WHITE]) {
+                    p.squares[address(file, rank)] = square::W_KING;
+                    continue;
+                }
+                if (read_bits(pp.data, pos, 1) == EMPTY_CODE.value) {
+                    p.squares[address(file, rank)] = square::EMPTY;
+                    continue;
+                }
+                pos--; // 先頭の1bitは駒の符号の一部なので読み直す
+                const type_t t = read_code(pp.data, pos, BOARD_CODE);
+                const bool promoted = (t != type::GOLD) && read_bits(pp.data, pos, 1);
+                const bool white = read_bits(pp.data, pos, 1);
+                p.squares[address(file, rank)] = (white ? square::W : 0) | (promoted ? square::promote(t) : t);
+            }
+        }
+
+        // 持ち駒
+        while (pos < BITS) {
+            const type_t t = read_code(pp.data, pos, HAND_CODE);
+            if (t != type::GOLD) {
+                read_bits(pp.data, pos, 1);
+            }
+            p.pieces_in_hand[read_bits(pp.data, pos, 1)][t]++;
+        }
+
+        // 256bitに収まっても駒の数があり得なければ壊れている
+        int count[7] = {};
+        for (int i = 11; i <= 99; i++) {
+            if (p.squares[i] != square::EMPTY && p.squares[i] != square::WALL && square::type_of(p.squares[i]) != type::KING) {
+                count[square::type_of(square::unpromote(p.squares[i]))]++;
+            }
+        }
+        for (type_t t = type::PAWN; t <= type::GOLD; t++) {
+            if (count[t] + p.pieces_in_hand[side::BLACK][t] + p.pieces_in_hand[side::WHITE][t] > PIECE_MAX[t]) {
+                throw std::runtime_error("unpack: broken data");
+            }
+        }
+
+        rebuild(p);
+        return p;
+    }
+}
@@ -3,75 +3,413 @@
 namespace tenuki {
 
     namespace {
-        int search(const position& p, int depth, move_t prev, move_t& out_move);
-        int alphabeta(const position& p, int depth, int a, int b);
-        int quies(const position& p, int depth, int a, int b);
+        constexpr int MAX_PLY = 64;
+
+        // 置換表の評価値の種類
+        constexpr uint8_t EXACT = 0; // 正確な値
+        constexpr uint8_t LOWER = 1; // 下限（本当の値はこれ以上）
+        constexpr uint8_t UPPER = 2; // 上限（本当の値はこれ以下）
+
+        constexpr int MATE = 15000; // 玉を取った局面の評価値（static_value）
+
+        /**
+         * 探索スレッドごとの状態
+         */
+        struct context {
+            tt_entry* table;
+            uint64_t table_mask;
+            std::atomic<bool>* stopped;
+            bool has_deadline;
+            std::chrono::steady_clock::time_point deadline;
+            uint64_t nodes;
+            std::mt19937 gen;
+            bool verbose; // ルートの読みをstd::cerrに出すか
+        };
+
+        // 探索は手番Sで特殊化し, 先手ならmaxノード, 後手ならminノードになる. 手番での分岐はルートで1回だけ
+        template <side_t S> int search(context& c, const position& p, int depth, move_t prev, const std::vector<move_t>& excluded, move_t* out_pv);
+        template <side_t S> int alphabeta(context& c, const position& p, int depth, int a, int b, move_t* out_pv);
+        template <side_t S> int quies(context& c, const position& p, int depth, int a, int b);
+        inline bool probe(const context& c, uint64_t key, int& score, move_t& m, int& depth, uint8_t& bound);
+        inline void store(context& c, uint64_t key, int score, move_t m, int depth, uint8_t bound);
     }
 
+    /**
+     * 1秒考えて指し手を返す
+     */
     move_t ponder(const position& p) {
-        boost::timer t;
-        std::vector<std::tuple<move_t, int>> moves;
+        static searcher s;
+        search_limits limits;
+        limits.seconds = 1.0;
+        s.set_position(p);
+        s.go(limits);
+        return s.wait().move;
+    }
 
-        // move_t m = 0;
-        // return search(p, 5, m, m);
+    /**
+     * 上位multipv個の手を, それぞれ正確な評価値と読み筋つきで返す.
+     * 深さごとに, 見つかった手を除外しながらmultipv回ルートを探索し, 結果をstd::coutに出す.
+     */
+    std::vector<variation> analyze(const position& p, int multipv, double seconds) {
+        searcher s;
+        search_limits limits;
+        limits.seconds = seconds;
+        limits.multipv = multipv;
+        limits.on_iteration = [&](const std::vector<variation>& lines, int depth) {
+            for (size_t k = 0; k < lines.size(); k++) {
+                std::cout << "depth " << depth << " multipv " << k + 1 << " score " << lines[k].score << " pv " << to_string(lines[k], p) << "\n";
+            }
+        };
+        s.set_position(p);
+        s.go(limits);
+        return s.wait().lines;
+    }
+
+    /**
+     * 読み筋を空白区切りのCSA形式にする
+     */
+    const std::string to_string(const variation& v, position p) {
+        std::string s;
+        for (move_t m : v.moves) {
+            s += (s.empty() ? "" : " ") + to_string(m, p);
+            p = do_move(p, m);
+        }
+        return s;
+    }
+
+
+    /**
+     * threads本の探索スレッドとhash_mb MBの置換表を持つ探索器を作る.
+     * shm_nameを指定すると, 置換表を同じ名前を指定したほかのプロセスと共有する（hash_mbも揃えること）.
+     * huge_pagesならhuge pageを使うようにカーネルに頼む.
+     */
+    searcher::searcher(int threads, int hash_mb, const std::string& shm_name, bool huge_pages)
+        : shm_name(shm_name), generation(0), running(0), quit(false), stopped(false), nodes(0) {
+        size_t size = 1;
+        while (size * 2 * sizeof(tt_entry) <= (size_t)std::max(hash_mb, 1) << 20) {
+            size *= 2;
+        }
+        table = open_table(size, shm_name, huge_pages, shm_fd);
+        table_mask = size - 1;
+        root = parse_position("lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1");
+        for (int i = 0; i < std::max(threads, 1); i++) {
+            this->threads.emplace_back(&searcher::loop, this, i);
+        }
+    }
 
-        move_t m = 0;
-        for (int depth = 1; t.elapsed() < 1.0; depth++) {
-            int score = search(p, depth, m, m);
-            moves.push_back(std::make_tuple(m, score));
+    searcher::~searcher() {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
         }
-        for (int i = moves.size() - 1; i >= 0; i--) {
-            if ((p.side_to_move == side::BLACK) ? std::get<1>(moves[i]) > -15000 : std::get<1>(moves[i]) < 15000) {
-                return std::get<0>(moves[i]);
+        cv.notify_all();
+        for (std::thread& t : threads) {
+            t.join();
+        }
+        close_table(table, table_mask + 1, shm_name, shm_fd);
+    }
+
+    void searcher::set_position(const position& p) {
+        wait();
+        root = p;
+    }
+
+    /**
+     * 探索を始めてすぐ返る. 結果はwait()で受け取る.
+     */
+    void searcher::go(const search_limits& limits) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return running == 0; });
+        this->limits = limits;
+        seeds.resize(threads.size());
+        for (size_t i = 0; i < threads.size(); i++) {
+            seeds[i] = (limits.seed >= 0) ? limits.seed + i : seed_gen(); // random_deviceは1つを同時に引けないのでここで引く
+        }
+        result = search_result();
+        nodes = 0;
+        stopped = false;
+        start = std::chrono::steady_clock::now();
+        running = threads.size();
+        generation++;
+        cv.notify_all();
+    }
+
+    void searcher::stop() {
+        stopped = true;
+    }
+
+    const search_result& searcher::wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return running == 0; });
+        return result;
+    }
+
+    /**
+     * 置換表を空にする（共有していればほかのプロセスの分も消える）
+     */
+    void searcher::clear() {
+        wait();
+        for (uint64_t i = 0; i <= table_mask; i++) {
+            table[i].check = 0;
+            table[i].data = 0;
+        }
+    }
+
+    /**
+     * ルートの手mだけを窓(a, b)で深さdepthまで探索する（クラスタ探索のワーカ用）.
+     * hintはmのあとの読み筋（前の深さでどこかのワーカが返したもの）で, 置換表に無い局面にはその手を置換表の手として入れてから読む.
+     * out_pvにmのあとの読み筋を返す. 呼んだスレッドで探索し, 置換表は次の呼び出しに引き継がれる.
+     */
+    int searcher::search_move(const position& p, move_t m, int depth, int a, int b, const std::vector<move_t>& hint, std::vector<move_t>& out_pv) {
+        wait();
+        stopped = false;
+        context c {table, table_mask, &stopped, false, {}, 0, std::mt19937(), false};
+        const position q = do_move(p, m);
+        position r = q;
+        for (move_t h : hint) {
+            int tt_score;
+            move_t tt_move;
+            int tt_depth;
+            uint8_t tt_bound;
+            if (!probe(c, r.key, tt_score, tt_move, tt_depth, tt_bound)) {
+                store(c, r.key, 0, h, 0, UPPER); // 深さ0なのでカットには使われず, 手の順番にだけ効く
             }
+            r = do_move(r, h);
+        }
+        move_t pv[MAX_PLY];
+        const int score = (q.side_to_move == side::BLACK) ? alphabeta<side::BLACK>(c, q, depth - 1, a, b, pv) : alphabeta<side::WHITE>(c, q, depth - 1, a, b, pv);
+        out_pv.clear();
+        for (int i = 0; pv[i] != 0; i++) {
+            out_pv.push_back(pv[i]);
         }
-        return std::get<0>(moves[0]);
+        return score;
     }
 
+    void searcher::loop(int id) {
+        for (uint64_t seen = 0; ; ) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return quit || generation != seen; });
+                if (quit) {
+                    return;
+                }
+                seen = generation;
+            }
+            think(id);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--running == 0) {
+                    result.nodes = nodes; // 全スレッドの局面数
+                    profile::report(std::cerr);
+                    if (limits.on_done) {
+                        limits.on_done(result); // wait()が返る前に呼び終える
+                    }
+                }
+            }
+            cv.notify_all();
+        }
+    }
+
+    /**
+     * 反復深化. id 0のスレッドが結果を作り, ほかのスレッドは同じ置換表を使って並行に読むだけ.
+     */
+    void searcher::think(int id) {
+
+        profile::scope scope(profile::SEARCH);
+        context c {table, table_mask, &stopped, limits.hard_seconds > 0, start, 0, std::mt19937(seeds[id]), id == 0 && limits.verbose};
+        c.deadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(limits.hard_seconds));
+        auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+        std::vector<variation> lines;
+        std::vector<std::tuple<move_t, int>> history; // 深さごとの最善手と評価値
+        int completed = 0;
+
+        for (int depth = 1 + id % 2; depth < MAX_PLY && !stopped; depth++) {
+            if (id == 0 && ((limits.depth > 0 && depth > limits.depth) || (limits.seconds > 0 && depth > 1 && elapsed() >= limits.seconds))) {
+                break;
+            }
+            std::vector<variation> next;
+            std::vector<move_t> excluded;
+            for (int k = 0; k < (id == 0 ? std::max(limits.multipv, 1) : 1); k++) {
+                move_t pv[MAX_PLY];
+                const move_t prev = k < (int)lines.size() ? lines[k].moves[0] : 0;
+                const int score = (root.side_to_move == side::BLACK) ? search<side::BLACK>(c, root, depth, prev, excluded, pv) : search<side::WHITE>(c, root, depth, prev, excluded, pv);
+                if (pv[0] == 0 || stopped) {
+                    break; // もう指せる手がないか, 打ち切られた
+                }
+                variation v {score, {}};
+                for (int i = 0; pv[i] != 0; i++) {
+                    v.moves.push_back(pv[i]);
+                }
+                next.push_back(v);
+                excluded.push_back(pv[0]);
+            }
+            if (stopped && depth > 1) {
+                break; // 読みかけの深さの結果は使わない
+            }
+            lines = next;
+            completed = depth;
+            if (!lines.empty()) {
+                history.push_back(std::make_tuple(lines[0].moves[0], lines[0].score));
+            }
+            if (id == 0 && limits.on_iteration) {
+                limits.on_iteration(lines, depth);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        nodes += c.nodes;
+        if (id != 0) {
+            return;
+        }
+        stopped = true; // ほかのスレッドを止める
+
+        result.lines = lines;
+        result.depth = completed;
+        result.move = 0;
+        result.score = lines.empty() ? 0 : lines[0].score;
+        for (int i = history.size() - 1; i >= 0; i--) {
+            if ((root.side_to_move == side::BLACK) ? std::get<1>(history[i]) > -15000 : std::get<1>(history[i]) < 15000) {
+                result.move = std::get<0>(history[i]);
+                break;
+            }
+        }
+        if (result.move == 0 && !history.empty()) {
+            result.move = std::get<0>(history[0]);
+        }
+        if (result.move == 0) {
+            move_t moves[593];
+            if (legal_moves(root, moves) > 0) {
+                result.move = moves[0]; // 1手も読み終えられなかった
+            }
+        }
+        result.seconds = elapsed();
+    }
+
+
     namespace {
 
-        std::random_device seed_gen;
+        /**
+         * 打ち切るならtrueを返す
+         */
+        inline bool aborted(context& c) {
+            if (c.has_deadline && (c.nodes & 4095) == 0 && std::chrono::steady_clock::now() >= c.deadline) {
+                *c.stopped = true;
+            }
+            return c.stopped->load(std::memory_order_relaxed);
+        }
+
+        inline bool probe(const context& c, uint64_t key, int& score, move_t& m, int& depth, uint8_t& bound) {
+            const tt_entry& e = c.table[(key >> 1) & c.table_mask];
+            const uint64_t data = e.data.load(std::memory_order_relaxed);
+            if ((e.check.load(std::memory_order_relaxed) ^ data) != key) {
+                return false;
+            }
+            score = (int16_t)(data & 0xffff);
+            m = (data >> 16) & 0xffff;
+            depth = (int8_t)((data >> 32) & 0xff);
+            bound = (data >> 40) & 0xff;
+            return true;
+        }
+
+        inline void store(context& c, uint64_t key, int score, move_t m, int depth, uint8_t bound) {
+            tt_entry& e = c.table[(key >> 1) & c.table_mask];
+            score = std::max(-32767, std::min(32767, score)); // 下限・上限としては広げる方向に丸めても正しい
+            const uint64_t data = (uint64_t)(uint16_t)score | (uint64_t)m << 16 | (uint64_t)(uint8_t)depth << 32 | (uint64_t)bound << 40;
+            e.data.store(data, std::memory_order_relaxed);
+            e.check.store(key ^ data, std::memory_order_relaxed);
+        }
+
+        /**
+         * [first, last)を混ぜる. std::shuffleは標準ライブラリによって結果が違うので自前で書く.
+         */
+        inline void shuffle(move_t* first, move_t* last, std::mt19937& gen) {
+            for (int i = last - first - 1; i > 0; i--) {
+                std::swap(first[i], first[gen() % (i + 1)]);
+            }
+        }
+
+        /**
+         * out_pvをmの後ろに子の読み筋pvを続けたものにする
+         */
+        inline void update_pv(move_t* out_pv, move_t m, const move_t* pv) {
+            out_pv[0] = m;
+            int i = 0;
+            for (; pv[i] != 0 && i < MAX_PLY - 2; i++) {
+                out_pv[i + 1] = pv[i];
+            }
+            out_pv[i + 1] = 0;
+        }
+
+        /**
+         * 駒を取らない手のうち, 相手の駒が利いていて味方の駒が利いていない升へ行く手を後ろに回す（順序は保つ）
+         */
+        template <side_t S>
+        inline void order_moves(const position& p, move_t* moves, int length) {
+            move_t unsafe[593];
+            int n = 0;
+            int k = 0;
+            for (int i = 0; i < length; i++) {
+                const int to = move::to(moves[i]);
+                // 盤上の駒を動かす手なら, 動かす駒自身の利きが1つ数えられている
+                if (p.squares[to] == square::EMPTY && p.effect[side::opponent(S)][to] > 0 && p.effect[S][to] <= (move::is_drop(moves[i]) ? 0 : 1)) {
+                    unsafe[n++] = moves[i];
+                } else {
+                    moves[k++] = moves[i];
+                }
+            }
+            std::copy(&unsafe[0], &unsafe[n], &moves[k]);
+        }
 
-        int search(const position& p, int depth, move_t prev, move_t& out_move) {
+        /**
+         * 手番Sから見てxがyより良いか（先手は大きいほど, 後手は小さいほど良い）
+         */
+        template <side_t S>
+        constexpr bool better(int x, int y) {
+            return S == side::BLACK ? x > y : x < y;
+        }
 
-            static std::mt19937 gen(seed_gen());
+        /**
+         * ルートの探索. excludedの手は探索しない.
+         * @param out_pv 読み筋（0終端）. 指せる手がなければout_pv[0]は0
+         */
+        template <side_t S>
+        int search(context& c, const position& p, int depth, move_t prev, const std::vector<move_t>& excluded, move_t* out_pv) {
 
+            out_pv[0] = 0;
             move_t moves[593];
-            int length = legal_moves(p, moves);
+            int length = legal_moves<S>(p, moves);
+            length = std::remove_if(&moves[0], &moves[length], [&](move_t m) { return std::find(excluded.begin(), excluded.end(), m) != excluded.end(); }) - &moves[0];
             if (length == 0) {
                 return 0;
             }
-            std::shuffle(&moves[0], &moves[length - 1], gen);
+            shuffle(&moves[0], &moves[length - 1], c.gen);
             if (prev != 0) {
                 std::swap(moves[0], *std::find(&moves[0], &moves[length - 1], prev));
             }
 
             int a = std::numeric_limits<int>::min();
             int b = std::numeric_limits<int>::max();
-            std::cerr << depth << ": ";
-            if (p.side_to_move == side::BLACK) {
-                // maxノード
-                for (int i = 0; i < length; i++) {
-                    int score = alphabeta(do_move(p, moves[i]), depth - 1, a, b);
-                    if (score > a) {
-                        a = score;
-                        out_move = moves[i];
-                        std::cerr << to_string(moves[i], p) << "(" << score <<") ";
-                    }
-                }
-            } else {
-                // minノード
-                for (int i = 0; i < length; i++) {
-                    int score = alphabeta(do_move(p, moves[i]), depth - 1, a, b);
-                    if (score < b) {
-                        b = score;
-                        out_move = moves[i];
+            int& own = (S == side::BLACK) ? a : b; // 手番側が更新する値
+            move_t pv[MAX_PLY];
+            if (c.verbose) {
+                std::cerr << depth << ": ";
+            }
+            for (int i = 0; i < length; i++) {
+                int score = alphabeta<side::opponent(S)>(c, do_move<S>(p, moves[i]), depth - 1, a, b, pv);
+                if (better<S>(score, own) && !c.stopped->load(std::memory_order_relaxed)) {
+                    own = score;
+                    update_pv(out_pv, moves[i], pv);
+                    if (c.verbose) {
                         std::cerr << to_string(moves[i], p) << "(" << score <<") ";
                     }
                 }
             }
-            std::cerr << "\n";
-            return (p.side_to_move == side::BLACK) ? a : b;
+            if (c.verbose) {
+                std::cerr << "\n";
+            }
+            return own;
         }
 
         /**
@@ -80,86 +418,119 @@ namespace tenuki {
          * @param depth
          * @param a 探索済みminノードの最大値
          * @param b 探索済みmaxノードの最小値
+         * @param out_pv 読み筋（0終端）
          */
-        int alphabeta(const position& p, int depth, int a, int b) {
+        template <side_t S>
+        int alphabeta(context& c, const position& p, int depth, int a, int b, move_t* out_pv) {
 
+            out_pv[0] = 0;
             if (depth <= 0) {
-                return quies(p, 4, a, b);
+                return quies<S>(c, p, 4, a, b);
                 //return static_value(p);
             }
 
+            c.nodes++;
+            if (aborted(c)) {
+                return 0;
+            }
+
+            int tt_score;
+            move_t tt_move = 0;
+            int tt_depth;
+            uint8_t tt_bound;
+            if (probe(c, p.key, tt_score, tt_move, tt_depth, tt_bound) && tt_depth >= depth) {
+                if (tt_bound == EXACT) {
+                    return std::max(a, std::min(b, tt_score));
+                }
+                if (tt_bound == LOWER && tt_score >= b) {
+                    return b;
+                }
+                if (tt_bound == UPPER && tt_score <= a) {
+                    return a;
+                }
+            }
+
+            // 1手詰なら次の手で玉を取れる
+            const move_t mate = mate_in_one<S>(p);
+            if (mate != 0) {
+                const int score = (S == side::BLACK) ? MATE : -MATE;
+                store(c, p.key, score, mate, depth, EXACT);
+                out_pv[0] = mate;
+                out_pv[1] = 0;
+                return std::max(a, std::min(b, score));
+            }
+
             move_t moves[593];
-            int length = legal_moves(p, moves);
+            int length = legal_moves<S>(p, moves);
             if (length == 0) {
                 return static_value(p);
             }
+            order_moves<S>(p, moves, length);
+            if (tt_move != 0) {
+                move_t* it = std::find(&moves[0], &moves[length], tt_move);
+                if (it != &moves[length]) {
+                    std::swap(moves[0], *it); // 置換表の手を先に読む
+                }
+            }
 
-            if (p.side_to_move == side::BLACK) {
-                // maxノード
-                for (int i = 0; i < length; i++) {
-                    a = std::max(a, alphabeta(do_move(p, moves[i]), depth - 1, a, b));
-                    if (a >= b) {
-                        return b; // bカット
-                    }
+            // 先手（maxノード）はaを上げてbでカット, 後手（minノード）はbを下げてaでカット
+            int& own = (S == side::BLACK) ? a : b;
+            int& cut = (S == side::BLACK) ? b : a;
+            const int own0 = own;
+            move_t best = tt_move;
+            move_t pv[MAX_PLY];
+            for (int i = 0; i < length; i++) {
+                int score = alphabeta<side::opponent(S)>(c, do_move<S>(p, moves[i]), depth - 1, a, b, pv);
+                if (c.stopped->load(std::memory_order_relaxed)) {
+                    return 0;
                 }
-                return a;
-            } else {
-                // minノード
-                for (int i = 0; i < length; i++) {
-                    b = std::min(b, alphabeta(do_move(p, moves[i]), depth - 1, a, b));
-                    if (a >= b) {
-                        return a; // aカット
-                    }
+                if (better<S>(score, own)) {
+                    own = score;
+                    best = moves[i];
+                    update_pv(out_pv, moves[i], pv);
+                }
+                if (a >= b) {
+                    store(c, p.key, cut, best, depth, S == side::BLACK ? LOWER : UPPER);
+                    return cut;
                 }
-                return b;
             }
+            store(c, p.key, own, best, depth, better<S>(own, own0) ? EXACT : S == side::BLACK ? UPPER : LOWER);
+            return own;
         }
 
-        int quies(const position& p, int depth, int a, int b) {
+        template <side_t S>
+        int quies(context& c, const position& p, int depth, int a, int b) {
 
+            c.nodes++;
             int standpat = static_value(p);
+            int& own = (S == side::BLACK) ? a : b;
+            int& cut = (S == side::BLACK) ? b : a;
             if (depth == 0) {
+                // 葉でも1手詰なら玉を取れる（すでにカットされる値なら調べなくてよい）
+                if (better<S>(cut, standpat) && mate_in_one<S>(p) != 0) {
+                    return std::max(a, std::min(b, (S == side::BLACK) ? MATE : -MATE));
+                }
                 return standpat;
             }
             move_t moves[128];
 
-            if (p.side_to_move == side::BLACK) {
-                if (b <= standpat) {
-                    return b;
-                }
-                if (a < standpat) {
-                    a = standpat;
-                }
-                int length = capturel_moves(p, moves);
-                for (int i = 0; i < length; i++) {
-                    int value = quies(do_move(p, moves[i]), depth - 1, a, b);
-                    if (b <= value) {
-                        return b;
-                    }
-                    if (a < value) {
-                        a = value;
-                    }
-                }
-                return a;
-            } else {
-                if (a >= standpat) {
-                    return a;
-                }
-                if (b > standpat) {
-                    b = standpat;
+            if (!better<S>(cut, standpat)) {
+                return cut;
+            }
+            if (better<S>(standpat, own)) {
+                own = standpat;
+            }
+            int length = capturel_moves<S>(p, moves);
+            for (int i = 0; i < length; i++) {
+                int value = quies<side::opponent(S)>(c, do_move<S>(p, moves[i]), depth - 1, a, b);
+                if (!better<S>(cut, value)) {
+                    return cut;
                 }
-                int length = capturel_moves(p, moves);
-                for (int i = 0; i < length; i++) {
-                    int value = quies(do_move(p, moves[i]), depth - 1, a, b);
-                    if (a >= value) {
-                        return a;
-                    }
-                    if (b > value) {
-                        b = value;
-                    }
+                if (better<S>(value, own)) {
+                    own = value;
                 }
-                return b;
             }
+            return own;
         }
 
     }
@@ -95,6 +95,7 @@ namespace tenuki {
             }
         }
 
+
         // 持ち駒
         if (pieces_in_hand != "-") {
             static const std::regex re("(\\d*)(\\D)"); // 例：S, 4P, b, 3n, p, 18P
@@ -105,10 +106,58 @@ namespace tenuki {
             }
         }
 
+        rebuild(p);
         return p;
     }
 
 
+    const zobrist_table ZOBRIST;
+
+    /**
+     * squares, pieces_in_hand, side_to_moveから駒リスト, 利きとハッシュ値を作り直す
+     * 片方の盤上の駒が40枚を超えたらruntime_errorを投げる.
+     */
+    void rebuild(position& p) {
+        std::fill(std::begin(p.piece_count), std::end(p.piece_count), 0);
+        std::fill(std::begin(p.king_address), std::end(p.king_address), 0);
+        for (int i = 11; i <= 99; i++) {
+            if (p.squares[i] == square::EMPTY || p.squares[i] == square::WALL) {
+                continue;
+            }
+            const side_t s = square::is_black(p.squares[i]) ? side::BLACK : side::WHITE;
+            if (p.piece_count[s] == sizeof p.piece_list[s]) {
+                throw std::runtime_error("rebuild: too many pieces");
+            }
+            p.piece_index[i] = p.piece_count[s];
+            p.piece_list[s][p.piece_count[s]++] = i;
+            if (square::type_of(p.squares[i]) == type::KING) {
+                p.king_address[s] = i;
+            }
+        }
+        compute_effects(p);
+        p.key = compute_key(p);
+    }
+
+
+    /**
+     * ハッシュ値を一から計算する
+     */
+    uint64_t compute_key(const position& p) {
+        uint64_t key = p.side_to_move;
+        for (int i = 11; i <= 99; i++) {
+            if (p.squares[i] != square::EMPTY && p.squares[i] != square::WALL) {
+                key += ZOBRIST.board[p.squares[i]][i];
+            }
+        }
+        for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+            for (type_t t = type::PAWN; t <= type::KING; t++) {
+                key += ZOBRIST.hand[s][t] * p.pieces_in_hand[s][t];
+            }
+        }
+        return key;
+    }
+
+
     /**
      * to_sfen
      */
@@ -132,6 +181,23 @@ namespace tenuki {
         for (int i = 9; i >= 2; i--) {
             boost::algorithm::replace_all(s, string(i, '1'), std::to_string(i)); // '1'をまとめる
         }
+
+        // 手番
+        s += (p.side_to_move == side::BLACK) ? " b " : " w ";
+
+        // 持ち駒（飛,角,金,銀,桂,香,歩の順）
+        static const type_t HAND_ORDER[] = {type::ROOK, type::BISHOP, type::GOLD, type::SILVER, type::KNIGHT, type::LANCE, type::PAWN};
+        string hand;
+        for (side_t c = side::BLACK; c <= side::WHITE; c++) {
+            for (type_t t : HAND_ORDER) {
+                const int n = p.pieces_in_hand[c][t];
+                if (n > 0) {
+                    hand += (n > 1 ? std::to_string(n) : "") + TO_SFEN.at(c << 4 | t);
+                }
+            }
+        }
+        s += hand.empty() ? "-" : hand;
+        s += " 1";
         return s;
     }
 
@@ -140,6 +206,7 @@ namespace tenuki {
      */
     int16_t static_value(const position& p) {
 
+        profile::scope scope(profile::STATIC_VALUE);
         //   歩,   香,   桂,   銀,   角,   飛,   金,    王,   と, 成香, 成桂, 成銀,   馬,   龍, 空, 壁
         static const int16_t SCORE[] = {
              87,  235,  254,  371,  571,  647,  447,  9999,  530,  482,  500,  489,  832,  955,  0,  0,
@@ -160,6 +227,23 @@ namespace tenuki {
         for (int t = type::PAWN; t <= type::ROOK; t++) {
             result += (p.pieces_in_hand[side::BLACK][t] - p.pieces_in_hand[side::WHITE][t]) * SCORE[t];
         }
+
+        // 玉の周り8升に相手の駒が利いている数だけ減点する
+        static const int AROUND[] { -11, -10, -9, -1, +1, +9, +10, +11 };
+        static const int16_t KING_DANGER = 12;
+        for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+            const int king = p.king_address[s];
+            if (king == 0) {
+                continue;
+            }
+            int danger = 0;
+            for (int v : AROUND) {
+                if (p.squares[king + v] != square::WALL) {
+                    danger += p.effect[side::opponent(s)][king + v];
+                }
+            }
+            result += (s == side::BLACK ? -KING_DANGER : KING_DANGER) * danger;
+        }
         return result;
     }
 
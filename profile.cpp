@@ -0,0 +1,132 @@
+#include "tenuki.h"
+
+#ifdef TENUKI_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace tenuki {
+
+    namespace profile {
+
+        namespace {
+
+            struct counters {
+                uint64_t cycles[REGIONS];
+                uint64_t calls[REGIONS];
+            };
+
+            void print(std::ostream& os, const char* title, const counters& c);
+            counters sum();
+
+            /**
+             * 全スレッドのカウンタ. 終了したスレッドの分はretiredに足し込む.
+             * プロセス終了時（このオブジェクトの破棄時）に累計のレポートを出す.
+             */
+            struct registry {
+                std::mutex mutex;
+                std::vector<counters*> live;
+                counters retired {};
+                counters reported {}; // 前回report()したときの累計
+
+                ~registry() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    print(std::cerr, "total", sum());
+                }
+            };
+
+            registry& get_registry() {
+                static registry r;
+                return r;
+            }
+
+            // 起動時に作っておき, 関数内staticの探索器などより後に壊す
+            struct registry_init {
+                registry_init() { get_registry(); }
+            } init;
+
+            struct thread_counters {
+                counters c {};
+
+                thread_counters() {
+                    registry& r = get_registry();
+                    std::lock_guard<std::mutex> lock(r.mutex);
+                    r.live.push_back(&c);
+                }
+
+                ~thread_counters() {
+                    registry& r = get_registry();
+                    std::lock_guard<std::mutex> lock(r.mutex);
+                    for (int i = 0; i < REGIONS; i++) {
+                        r.retired.cycles[i] += c.cycles[i];
+                        r.retired.calls[i] += c.calls[i];
+                    }
+                    r.live.erase(std::find(r.live.begin(), r.live.end(), &c));
+                }
+            };
+
+            counters& local() {
+                get_registry(); // registryをthread_countersより先に作り, 後に壊す
+                thread_local thread_counters t;
+                return t.c;
+            }
+
+            /**
+             * 全スレッドの累計. registryのmutexを取って呼ぶ
+             */
+            counters sum() {
+                const registry& r = get_registry();
+                counters total = r.retired;
+                for (const counters* c : r.live) {
+                    for (int i = 0; i < REGIONS; i++) {
+                        total.cycles[i] += c->cycles[i];
+                        total.calls[i] += c->calls[i];
+                    }
+                }
+                return total;
+            }
+
+            void print(std::ostream& os, const char* title, const counters& c) {
+                static const char* NAMES[] = {"search", "legal_moves", "capturel_moves", "do_move", "static_value", "mate_in_one", "io"};
+                os << boost::format("profile: %15s %14s %14s %13s\n") % title % "cycles" % "calls" % "cycles/call";
+                for (int i = 0; i < REGIONS; i++) {
+                    os << boost::format("profile: %15s %14d %14d %13.1f\n") % NAMES[i] % c.cycles[i] % c.calls[i]
+                        % (c.calls[i] == 0 ? 0.0 : (double)c.cycles[i] / c.calls[i]);
+                }
+            }
+        }
+
+        uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+        }
+
+        void add(region_t r, uint64_t cycles) {
+            counters& c = local();
+            c.cycles[r] += cycles;
+            c.calls[r]++;
+        }
+
+        /**
+         * 前回のreport()からの分（1回の探索の内訳）を出す. 動いているスレッドの分は読んだ時点の値.
+         */
+        void report(std::ostream& os) {
+            registry& r = get_registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            const counters total = sum();
+            counters delta;
+            for (int i = 0; i < REGIONS; i++) {
+                delta.cycles[i] = total.cycles[i] - r.reported.cycles[i];
+                delta.calls[i] = total.calls[i] - r.reported.calls[i];
+            }
+            r.reported = total;
+            print(os, "region", delta);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,98 @@
+#include "tenuki.h"
+#include <cstdio>
+
+using namespace tenuki;
+using std::string;
+
+/*
+ * SFENのテキストファイル（1行1局面）と圧縮局面（1局面32byte）のバイナリファイルを相互に変換する.
+ * 標準入力から読んで標準出力に書く.
+ */
+
+namespace {
+
+    constexpr int CHUNK = 4096; // 一度に読み書きする局面数
+
+    /**
+     * SFENを1行ずつ詰める. 詰められない行（駒落ちなど40枚揃っていない局面や壊れた行）は飛ばして数える
+     */
+    int pack_stream(FILE* in, FILE* out) {
+        std::vector<packed_position> buf;
+        buf.reserve(CHUNK);
+        char line[1024];
+        long skipped = 0;
+        for (long n = 1; std::fgets(line, sizeof line, in) != nullptr; n++) {
+            string sfen = line;
+            boost::algorithm::trim(sfen);
+            if (sfen.empty()) {
+                continue;
+            }
+            try {
+                buf.push_back(pack(parse_position(sfen)));
+            } catch (const std::exception& e) {
+                if (skipped++ < 10) {
+                    std::cerr << "line " << n << ": " << e.what() << " (skipped)\n";
+                }
+                continue;
+            }
+            if (buf.size() == CHUNK) {
+                std::fwrite(buf.data(), sizeof(packed_position), buf.size(), out);
+                buf.clear();
+            }
+        }
+        std::fwrite(buf.data(), sizeof(packed_position), buf.size(), out);
+        if (skipped > 0) {
+            std::cerr << skipped << " lines skipped\n";
+        }
+        return 0;
+    }
+
+    /**
+     * 32byteずつ戻す. 壊れた局面や32byteに満たない末尾があればその局面の番号（0から）を出して失敗する
+     */
+    int unpack_stream(FILE* in, FILE* out) {
+        std::vector<packed_position> buf(CHUNK);
+        string text;
+        long index = 0;
+        for (size_t bytes; (bytes = std::fread(buf.data(), 1, buf.size() * sizeof(packed_position), in)) > 0; ) {
+            text.clear();
+            const size_t n = bytes / sizeof(packed_position);
+            for (size_t i = 0; i < n; i++, index++) {
+                try {
+                    text += to_sfen(unpack(buf[i]));
+                } catch (const std::exception& e) {
+                    std::fwrite(text.data(), 1, text.size(), out);
+                    std::cerr << "record " << index << ": " << e.what() << "\n";
+                    return 1;
+                }
+                text += '\n';
+            }
+            std::fwrite(text.data(), 1, text.size(), out);
+            if (bytes % sizeof(packed_position) != 0) {
+                std::cerr << "record " << index << ": truncated (" << bytes % sizeof(packed_position) << " bytes)\n";
+                return 1;
+            }
+        }
+        if (std::ferror(in)) {
+            std::cerr << "record " << index << ": read error\n";
+            return 1;
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2 || (string(argv[1]) != "pack" && string(argv[1]) != "unpack")) {
+        std::cerr << "Usage: sfenpack pack < in.sfen > out.bin\n";
+        std::cerr << "       sfenpack unpack < in.bin > out.sfen\n";
+        return 1;
+    }
+
+    static char inbuf[1 << 20];
+    static char outbuf[1 << 20];
+    std::setvbuf(stdin, inbuf, _IOFBF, sizeof inbuf);
+    std::setvbuf(stdout, outbuf, _IOFBF, sizeof outbuf);
+
+    return string(argv[1]) == "pack" ? pack_stream(stdin, stdout) : unpack_stream(stdin, stdout);
+}
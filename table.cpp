@@ -0,0 +1,180 @@
+#include "tenuki.h"
+#include <cerrno>
+#include <cstring>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+
+/*
+ * 置換表の確保
+ * shm_nameを指定すると, 名前つきのPOSIX共有メモリに置換表を置き, 同じ名前を指定した複数のプロセスで共有する.
+ *
+ * 共有メモリの先頭には table_header を置き, その後ろ（64byte目から）にエントリを並べる.
+ * 共有メモリはO_EXCLで作ったプロセスだけがflock(LOCK_EX)をかけたまま大きさとヘッダを書き, 書き終えたらLOCK_SHに替える.
+ * ほかのプロセスはLOCK_SHを取ってから大きさとヘッダを確かめる. 合わないとき, LOCK_EXが取れれば誰もつないでいない
+ * （落ちたプロセスの残骸）ので消して作り直し, 取れなければ（別の--hashや別のビルドが使っていれば）つながずに失敗する.
+ * 接続中のプロセスは共有メモリのfdにflock(LOCK_SH)をかけておく. 切り離すときに LOCK_EX が取れたら
+ * ほかに誰もいないので shm_unlink する. プロセスが落ちてもロックはカーネルが外すので, 次に切り離した
+ * プロセスが後始末をする. 書きかけのエントリは tt_entry の検査で捨てられる.
+ */
+
+namespace tenuki {
+
+    static_assert((std::is_same<uint64_t, unsigned long>::value ? ATOMIC_LONG_LOCK_FREE : ATOMIC_LLONG_LOCK_FREE) == 2, "tt_entry must be lock-free to live in shared memory");
+
+    namespace {
+
+        constexpr uint64_t MAGIC = 0x74656e756b693031; // "tenuki01"
+        constexpr size_t HEADER_SIZE = 64;
+
+        struct table_header {
+            uint64_t magic;
+            uint64_t entries;
+        };
+
+        [[noreturn]] void error(const string& what) {
+            throw std::runtime_error("table: " + what + ": " + std::strerror(errno));
+        }
+
+        void* map(size_t bytes, int fd, bool huge_pages) {
+            void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                error("mmap");
+            }
+            if (huge_pages) {
+                madvise(addr, bytes, MADV_HUGEPAGE); // 使えなければ普通のページのまま
+            }
+            return addr;
+        }
+
+        /**
+         * 名前がまだfdと同じ共有メモリを指しているか（ほかのプロセスにunlinkされていないか）
+         */
+        bool still_linked(const string& name, int fd) {
+            const int fd2 = shm_open(name.c_str(), O_RDWR, 0600);
+            if (fd2 < 0) {
+                return false;
+            }
+            struct stat st1, st2;
+            const bool same = fstat(fd, &st1) == 0 && fstat(fd2, &st2) == 0 && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+            close(fd2);
+            return same;
+        }
+    }
+
+
+    /**
+     * entries個のエントリを持つ置換表を確保する. 共有メモリならout_fdにfdを返す（そうでなければ-1）.
+     * 共有メモリがすでにあって大きさかヘッダが合わず, ほかのプロセスが使っていればruntime_errorを投げる.
+     */
+    tt_entry* open_table(uint64_t entries, const string& shm_name, bool huge_pages, int& out_fd) {
+
+        const size_t bytes = entries * sizeof(tt_entry);
+        out_fd = -1;
+        if (shm_name.empty()) {
+            return static_cast<tt_entry*>(map(bytes, -1, huge_pages));
+        }
+
+        const string name = (shm_name[0] == '/') ? shm_name : "/" + shm_name;
+        for (int retry = 0; ; retry++) {
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            const bool created = (fd >= 0);
+            if (!created && errno == EEXIST) {
+                fd = shm_open(name.c_str(), O_RDWR, 0600);
+                if (fd < 0 && errno == ENOENT) {
+                    continue; // 開く前に最後のプロセスにunlinkされた. 作り直す
+                }
+            }
+            if (fd < 0) {
+                error("shm_open " + name);
+            }
+            if (flock(fd, created ? LOCK_EX : LOCK_SH) != 0) { // 接続中の印. 作ったプロセスは書き終えるまで排他
+                error("flock");
+            }
+            if (!still_linked(name, fd)) {
+                close(fd); // 開いた直後に最後のプロセスにunlinkされた. 作り直す
+                continue;
+            }
+
+            if (created) {
+                if (ftruncate(fd, HEADER_SIZE + bytes) != 0) {
+                    const int e = errno;
+                    shm_unlink(name.c_str());
+                    close(fd);
+                    errno = e;
+                    error("ftruncate");
+                }
+                char* addr = static_cast<char*>(map(HEADER_SIZE + bytes, fd, huge_pages));
+                table_header* header = reinterpret_cast<table_header*>(addr);
+                header->entries = entries;
+                header->magic = MAGIC;
+                if (flock(fd, LOCK_SH) != 0) { // 書き終えた. ほかのプロセスを通す
+                    error("flock");
+                }
+                out_fd = fd;
+                return reinterpret_cast<tt_entry*>(addr + HEADER_SIZE);
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                error("fstat");
+            }
+            string problem;
+            if (st.st_size == 0) {
+                if (retry < 100) {
+                    close(fd); // 作ったプロセスがまだLOCK_EXを取っていない. 少し待つ
+                    usleep(1000);
+                    continue;
+                }
+                problem = "is not initialized";
+            } else if ((size_t)st.st_size != HEADER_SIZE + bytes) {
+                problem = "exists with a different size";
+            } else {
+                char* addr = static_cast<char*>(map(HEADER_SIZE + bytes, fd, huge_pages));
+                const table_header* header = reinterpret_cast<const table_header*>(addr);
+                if (header->magic == MAGIC && header->entries == entries) {
+                    out_fd = fd;
+                    return reinterpret_cast<tt_entry*>(addr + HEADER_SIZE);
+                }
+                munmap(addr, HEADER_SIZE + bytes);
+                problem = "was made by an incompatible build";
+            }
+
+            // 合わない. ほかに誰もつないでいなければ落ちたプロセスの残骸なので, 消して作り直す
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0 && still_linked(name, fd)) {
+                shm_unlink(name.c_str());
+                close(fd);
+                continue;
+            }
+            close(fd);
+            throw std::runtime_error("table: " + name + " " + problem);
+        }
+    }
+
+
+    /**
+     * open_tableで確保した置換表を返す. 共有メモリに最後まで残っていたプロセスならunlinkする.
+     */
+    void close_table(tt_entry* table, uint64_t entries, const string& shm_name, int fd) {
+
+        const size_t bytes = entries * sizeof(tt_entry);
+        if (fd < 0) {
+            munmap(table, bytes);
+            return;
+        }
+        munmap(reinterpret_cast<char*>(table) - HEADER_SIZE, HEADER_SIZE + bytes);
+        flock(fd, LOCK_UN);
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            const string name = (shm_name[0] == '/') ? shm_name : "/" + shm_name;
+            if (still_linked(name, fd)) {
+                shm_unlink(name.c_str());
+            }
+        }
+        close(fd);
+    }
+}
@@ -1,16 +1,23 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <random>
 #include <regex>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -49,6 +56,36 @@ namespace tenuki {
         square_t squares[111];
         uint8_t pieces_in_hand[2][8]; // [side_t][type_t]
         side_t side_to_move;          // 手番
+
+        /**
+         * 駒リスト
+         * piece_list[s][0]～piece_list[s][piece_count[s] - 1]が手番sの盤上の駒のアドレス.
+         * piece_index[address]はpiece_list内の添字（駒がある升についてのみ有効）.
+         */
+        uint8_t piece_count[2];       // [side_t]
+        uint8_t piece_list[2][40];    // [side_t][index]
+        uint8_t piece_index[100];     // [address]
+        uint8_t king_address[2];      // [side_t] 王のアドレス. 盤上になければ0
+
+        /**
+         * 利き
+         * effect[s][address]は手番sの駒がその升に利いている数.
+         * long_effect[s][address]はその升に届いている手番sの飛び利きの向き（bit番号はmove.cppのRAY_DELTAの添字）.
+         * 飛び利きは最初にぶつかった駒（壁を含む）の升まで数える. do_moveで差分を更新する.
+         */
+        uint8_t effect[2][111];       // [side_t][address]
+        uint8_t long_effect[2][111];  // [side_t][address]
+
+        uint64_t key;                 // ハッシュ値. 最下位bitは手番
+    };
+
+    /**
+     * 圧縮局面（256bit）
+     * 手番(1bit), 先手玉の位置(7bit), 後手玉の位置(7bit), 玉以外の79升(ハフマン符号), 持ち駒(ハフマン符号)の順に下位bitから詰める.
+     * 駒が40枚揃っていて両玉が盤上にある局面はちょうど256bitになる.
+     */
+    struct packed_position {
+        uint8_t data[32];
     };
 
     /**
@@ -57,6 +94,7 @@ namespace tenuki {
     namespace side {
         constexpr side_t BLACK = 0; // 先手
         constexpr side_t WHITE = 1; // 後手
+        constexpr side_t opponent(side_t s) { return s ^ 1; }
     }
 
     /**
@@ -176,6 +214,33 @@ namespace tenuki {
         constexpr int value(dir_t d) { return d >> 1; }
     }
 
+    /**
+     * ハッシュ値の乱数表
+     * 局面のハッシュ値は, 盤上の駒board[square_t][address]と持ち駒1枚ごとのhand[side_t][type_t]の総和に, 後手番なら1を足したもの.
+     * 足し算なのでdo_moveで差分を足し引きすればよい. 乱数はすべて偶数にしてあるので最下位bitが手番になる.
+     */
+    struct zobrist_table {
+        uint64_t board[32][111];
+        uint64_t hand[2][8];
+
+        constexpr zobrist_table() : board(), hand() {
+            uint64_t x = 0x9e3779b97f4a7c15; // splitmix64
+            for (int i = 0; i < 32 * 111 + 2 * 8; i++) {
+                uint64_t z = (x += 0x9e3779b97f4a7c15);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+                z = (z ^ (z >> 31)) & ~uint64_t(1);
+                if (i < 32 * 111) {
+                    board[i / 111][i % 111] = z;
+                } else {
+                    hand[(i - 32 * 111) / 8][(i - 32 * 111) % 8] = z;
+                }
+            }
+        }
+    };
+
+    extern const zobrist_table ZOBRIST;
+
     constexpr int address(int file, int rank) {
         return file * 10 + rank;
     }
@@ -212,26 +277,205 @@ namespace tenuki {
         return a[address];
     }
 
+    /**
+     * 読み筋
+     */
+    struct variation {
+        int score;
+        std::vector<move_t> moves; // moves[0]がルートの指し手
+    };
+
+    /**
+     * 区間ごとのサイクル数と呼び出し回数を数えるプロファイラ
+     * -DTENUKI_PROFILE をつけたときだけ有効. つけなければscopeは空の構造体になり, 何も生成されない.
+     * 使い方：関数の先頭に profile::scope scope(profile::DO_MOVE); と書く. 入れ子の区間は外側にも数える.
+     * report()は前回のreport()からの分を出す. プロセス終了時には累計を出す.
+     */
+    namespace profile {
+        enum region_t { SEARCH, LEGAL_MOVES, CAPTURE_MOVES, DO_MOVE, STATIC_VALUE, MATE_IN_ONE, IO, REGIONS };
+
+#ifdef TENUKI_PROFILE
+        uint64_t now();
+        void add(region_t r, uint64_t cycles);
+
+        class scope {
+        public:
+            explicit scope(region_t r) : r(r), start(now()) {}
+            ~scope() { add(r, now() - start); }
+            scope(const scope&) = delete;
+            scope& operator=(const scope&) = delete;
+        private:
+            region_t r;
+            uint64_t start;
+        };
+
+        void report(std::ostream& os);
+#else
+        class scope {
+        public:
+            constexpr explicit scope(region_t) {}
+        };
+
+        inline void report(std::ostream&) {}
+#endif
+    }
+
+    /**
+     * 置換表のエントリ
+     * dataとkey ^ dataを別々に書き, 読むときにkeyと合うか確かめる（ロックしない）.
+     */
+    struct tt_entry {
+        std::atomic<uint64_t> check; // key ^ data
+        std::atomic<uint64_t> data;  // 評価値(16bit), 手(16bit), 深さ(8bit), 評価値の種類(8bit)
+    };
+
+    /**
+     * 探索結果
+     */
+    struct search_result {
+        move_t move = 0;                // 指す手（負けと読んでいない最後の深さの最善手）
+        int score = 0;
+        int depth = 0;                  // 読み終えた深さ
+        std::vector<variation> lines;   // 読み終えた深さの読み筋（multipv個）
+        uint64_t nodes = 0;             // 全スレッドの局面数
+        double seconds = 0;
+    };
+
+    /**
+     * 探索の制限. 0は制限なし.
+     */
+    struct search_limits {
+        int depth = 0;             // この深さまで読む
+        double seconds = 0;        // これを過ぎたら次の深さに進まない
+        double hard_seconds = 0;   // これを過ぎたら読みかけでも打ち切る
+        int multipv = 1;           // 上位何手を読むか
+        int seed = -1;             // 0以上ならルートの手を混ぜる乱数の種を固定する（スレッドごとに+id）
+        bool verbose = true;       // ルートの読みをstd::cerrに出すか
+        std::function<void(const std::vector<variation>& lines, int depth)> on_iteration; // 深さごとに呼ばれる
+        std::function<void(const search_result& result)> on_done; // 探索が終わったら探索スレッドから呼ばれる（searcherを触らないこと）
+    };
+
+    /**
+     * 探索器
+     * スレッドと置換表を持ち続けるので, 1手ごとに作り直さずに使い回すと前の手の読みが次の手に効く.
+     */
+    class searcher {
+    public:
+        explicit searcher(int threads = 1, int hash_mb = 16, const std::string& shm_name = "", bool huge_pages = false);
+        ~searcher();
+        searcher(const searcher&) = delete;
+        searcher& operator=(const searcher&) = delete;
+
+        void set_position(const position& p);
+        void go(const search_limits& limits);
+        void stop();
+        const search_result& wait();
+        void clear();
+        int search_move(const position& p, move_t m, int depth, int a, int b, const std::vector<move_t>& hint, std::vector<move_t>& out_pv);
+
+    private:
+        void loop(int id);
+        void think(int id);
+
+        position root;
+        search_limits limits;
+        search_result result;
+        tt_entry* table;
+        uint64_t table_mask;
+        std::string shm_name; // 置換表を置く共有メモリの名前. 空なら共有しない
+        int shm_fd;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint64_t generation; // go()のたびに増える
+        int running;         // 探索中のスレッド数
+        bool quit;
+        std::atomic<bool> stopped;
+        std::chrono::steady_clock::time_point start;
+        uint64_t nodes;
+        std::random_device seed_gen;
+        std::vector<uint32_t> seeds; // スレッドごとの乱数の種. go()がmutexの下で引く
+    };
+
+    /*
+     * table.cpp
+     */
+    tt_entry* open_table(uint64_t entries, const std::string& shm_name, bool huge_pages, int& out_fd);
+    void close_table(tt_entry* table, uint64_t entries, const std::string& shm_name, int fd);
+
     /*
      * ponder.cpp
      */
     move_t ponder(const position& p);
+    std::vector<variation> analyze(const position& p, int multipv, double seconds);
+    const std::string to_string(const variation& v, position p);
+
+    /*
+     * cluster.cpp
+     */
+    void run_worker(const std::string& port);
+    move_t cluster_ponder(const position& p, int depth, const std::vector<std::string>& workers);
+
+    /*
+     * multi.cpp
+     */
+    void run_multi(const std::string& host, const std::string& port, const std::vector<std::pair<std::string, std::string>>& accounts, searcher& s, double seconds, int games);
 
     /*
      * position.cpp
      */
     const position parse_position(const std::string& sfen);
+    void rebuild(position& p);
+    uint64_t compute_key(const position& p);
     const std::string to_sfen(const position& p);
     const std::string to_ki2(const position& p);
     const std::string to_string(const position& p);
     int16_t static_value(const position& p);
 
+    /*
+     * pack.cpp
+     */
+    const packed_position pack(const position& p);
+    const position unpack(const packed_position& pp);
+
+    /*
+     * csa.cpp
+     */
+    using csa_callback = std::function<void(const position& p, move_t m, int seconds)>;
+    int read_csa(const char* begin, const char* end, const csa_callback& f);
+    int read_csa_file(const std::string& path, const csa_callback& f);
+    long read_csa_directory(const std::string& dir, int threads, const csa_callback& f);
+
     /*
      * move.cpp
      */
     const std::string to_string(move_t m, const position& p);
     move_t parse_move(const std::string& str, const position& p);
+    move_t parse_legal_move(const std::string& str, const position& p);
     const position do_move(position p, move_t m);
     int legal_moves(const position& p, move_t* out_moves);
     int capturel_moves(const position& p, move_t* out_moves);
+
+    // 手番Sで特殊化した版. 手番がわかっている探索の中ではこちらを呼ぶ（p.side_to_move == S であること）
+    template <side_t S> const position do_move(position p, move_t m);
+    template <side_t S> int legal_moves(const position& p, move_t* out_moves);
+    template <side_t S> int capturel_moves(const position& p, move_t* out_moves);
+    void compute_effects(position& p);
+    move_t mate_in_one(const position& p);
+    template <side_t S> move_t mate_in_one(const position& p);
+
+    /**
+     * 手番sの駒がaddressに利いているか
+     */
+    inline bool is_attacked(const position& p, int address, side_t s) {
+        return p.effect[s][address] > 0;
+    }
+
+    /**
+     * 手番側の玉に王手がかかっているか
+     */
+    inline bool in_check(const position& p) {
+        const int king = p.king_address[p.side_to_move];
+        return king != 0 && is_attacked(p, king, side::opponent(p.side_to_move));
+    }
 }
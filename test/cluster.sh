@@ -0,0 +1,27 @@
+#!/bin/sh
+# クラスタ探索のスケーリングを測る
+# 使い方: test/cluster.sh [depth] [sfen]
+# ローカルにワーカを1, 2, 4, 8個立ててマスタから探索し, 所要時間を出す.
+
+cd "$(dirname "$0")/.." || exit 1
+DEPTH=${1:-4}
+SFEN=${2:-"l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1"}
+BASE_PORT=4091
+
+for N in 1 2 4 8; do
+    PIDS=""
+    WORKERS=""
+    for i in $(seq 1 "$N"); do
+        PORT=$((BASE_PORT + i))
+        ./tenuki worker "$PORT" 2>/dev/null &
+        PIDS="$PIDS $!"
+        WORKERS="$WORKERS${WORKERS:+,}localhost:$PORT"
+    done
+    sleep 0.5
+    START=$(date +%s.%N)
+    MOVE=$(./tenuki cluster "$DEPTH" "$WORKERS" $SFEN 2>/dev/null)
+    END=$(date +%s.%N)
+    echo "workers=$N move=$MOVE time=$(awk "BEGIN { print $END - $START }")s"
+    kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+done
@@ -0,0 +1,72 @@
+#include "../tenuki.h"
+
+using namespace tenuki;
+
+/*
+ * pack/unpackの往復テスト
+ * 壊れたデータ（256bitに収まるが駒の数があり得ない局面）をunpackが受け付けないことも確かめる.
+ */
+int main() {
+
+    const std::vector<std::string> SFENS {
+        "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+        "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1",
+        "8l/1l+R2P3/p2pBG1pp/kps1p4/Nn1P2G2/P1P1P2PP/1PS6/1KSG3+r1/LN2+p3L w Sbgn3p 1",
+        "4k4/9/9/9/9/9/9/9/4K4 b 2R2B4G4S4N4L18P 1",
+        "4k4/9/9/9/9/9/9/9/4K4 w 2r2b4g4s4n4l18p 1",
+    };
+
+    std::mt19937 gen(0);
+    int count = 0;
+    for (const std::string& sfen : SFENS) {
+        position p = parse_position(sfen);
+        for (int ply = 0; ply < 256; ply++) {
+            const position q = unpack(pack(p));
+            if (to_sfen(q) != to_sfen(p) || static_value(q) != static_value(p)) {
+                std::cerr << "NG\n" << to_string(p) << to_string(q);
+                return 1;
+            }
+            count++;
+
+            // 適当に1手進める
+            move_t moves[593];
+            const int length = legal_moves(p, moves);
+            if (length == 0) {
+                break;
+            }
+            const position next = do_move(p, moves[std::uniform_int_distribution<int>(0, length - 1)(gen)]);
+            if (next.king_address[side::BLACK] == 0 || next.king_address[side::WHITE] == 0) {
+                break;
+            }
+            p = next;
+        }
+    }
+
+    // 両玉と後手の歩54枚と空き升25個でちょうど256bitになる
+    packed_position broken {};
+    int pos = 0;
+    auto write = [&](int value, int bits) {
+        for (int i = 0; i < bits; i++, pos++) {
+            broken.data[pos >> 3] |= ((value >> i) & 1) << (pos & 7);
+        }
+    };
+    write(0, 1);  // 先手番
+    write(80, 7); // 先手玉 9九
+    write(0, 7);  // 後手玉 1一
+    for (int i = 0; i < 79; i++) {
+        if (i < 54) {
+            write(0b1001, 4); // 歩, 成らず, 後手
+        } else {
+            write(0b0, 1);
+        }
+    }
+    try {
+        unpack(broken);
+        std::cerr << "NG: broken data accepted\n";
+        return 1;
+    } catch (const std::runtime_error&) {
+    }
+
+    std::cerr << "OK: " << count << " positions\n";
+    return 0;
+}
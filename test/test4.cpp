@@ -0,0 +1,79 @@
+#include "../tenuki.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace tenuki;
+
+/*
+ * CSA棋譜の読み込みテスト
+ * 引数にディレクトリを渡すと, その下の*.csaを全部読んで速度を出す.
+ */
+int main(int argc, char* argv[]) {
+
+    const std::string record =
+        "V2.2\r\n"
+        "N+black\r\n"
+        "N-white\r\n"
+        "P1-KY-KE-GI-KI-OU-KI-GI-KE-KY\r\n"
+        "P2 * -HI *  *  *  *  * -KA * \r\n"
+        "P3-FU-FU-FU-FU-FU-FU-FU-FU-FU\r\n"
+        "P4 *  *  *  *  *  *  *  *  * \r\n"
+        "P5 *  *  *  *  *  *  *  *  * \r\n"
+        "P6 *  *  *  *  *  *  *  *  * \r\n"
+        "P7+FU+FU+FU+FU+FU+FU+FU+FU+FU\r\n"
+        "P8 * +KA *  *  *  *  * +HI * \r\n"
+        "P9+KY+KE+GI+KI+OU+KI+GI+KE+KY\r\n"
+        "+\r\n"
+        "+7776FU\r\n"
+        "T3\r\n"
+        "-3334FU,T5\r\n"
+        "+8822UM\r\n"
+        "T12\r\n"
+        "'comment\r\n"
+        "-3122GI\r\n"
+        "T1\r\n"
+        "+0055KA\r\n"
+        "%TORYO\r\n"
+        "/\r\n"
+        "PI\r\n"
+        "+\r\n"
+        "+2726FU,T1\r\n";
+
+    std::vector<std::tuple<std::string, move_t, int>> log;
+    const int games = read_csa(record.data(), record.data() + record.size(), [&](const position& p, move_t m, int seconds) {
+        log.push_back(std::make_tuple(to_string(m, p), m, seconds));
+    });
+
+    const std::vector<std::tuple<std::string, int>> expected {
+        std::make_tuple("+7776FU", 3),
+        std::make_tuple("-3334FU", 5),
+        std::make_tuple("+8822UM", 12),
+        std::make_tuple("-3122GI", 1),
+        std::make_tuple("+0055KA", 0),
+        std::make_tuple("+2726FU", 1),
+    };
+    if (games != 2 || log.size() != expected.size()) {
+        std::cerr << "NG: " << games << " games, " << log.size() << " moves\n";
+        return 1;
+    }
+    for (size_t i = 0; i < log.size(); i++) {
+        if (std::get<0>(log[i]) != std::get<0>(expected[i]) || std::get<2>(log[i]) != std::get<1>(expected[i])) {
+            std::cerr << "NG: " << std::get<0>(log[i]) << " T" << std::get<2>(log[i]) << "\n";
+            return 1;
+        }
+    }
+    std::cerr << "OK\n";
+
+    if (argc >= 2) {
+        const int threads = (argc >= 3) ? std::stoi(argv[2]) : std::thread::hardware_concurrency();
+        std::atomic<long> moves(0);
+        const auto start = std::chrono::steady_clock::now();
+        const long n = read_csa_directory(argv[1], threads, [&](const position&, move_t, int) {
+            moves++;
+        });
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << n << " games, " << moves << " moves, " << elapsed << " sec (" << n / elapsed << " games/sec, " << threads << " threads)\n";
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "../tenuki.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <boost/asio.hpp>
+
+using namespace tenuki;
+using boost::asio::ip::tcp;
+
+/*
+ * 複数対局モードのテスト
+ * 決まった手順で指す仮のCSAサーバを立て, 3アカウントで2局ずつ同時に指させる.
+ * サーバはtenukiの手がすべて合法手であることと, 全対局が最後まで進むことと,
+ * どの手も手番を渡してから1手の持ち時間（SECONDS）ほどで返ってくることを確かめる.
+ * もう1つのアカウントには合法手でない手を送り, tenukiがそのセッションだけを切って, ほかの対局を続けることも確かめる.
+ */
+namespace {
+
+    const int ACCOUNTS = 3;
+    const int GAMES = 2;
+    const int PLIES = 8; // 1局の手数. ここで#MAX_MOVESにする
+    const double SECONDS = 0.3; // 1手の持ち時間
+    const double MARGIN = 0.1;  // 通信と探索を止めるまでの遅れとして許す時間
+
+    std::atomic<int> finished(0);  // 最後まで進んだ対局数
+    std::atomic<int> playing(0);   // 進行中の対局数
+    std::atomic<int> max_playing(0);
+    std::atomic<bool> failed(false);
+    std::atomic<long> slowest(0); // 手番を渡してから手が返るまでの最長（マイクロ秒）
+    std::atomic<bool> dropped(false); // 合法手でない手を送ったセッションが切られたか
+
+    void write_line(tcp::socket& socket, const std::string& s) {
+        boost::asio::write(socket, boost::asio::buffer(s + "\n"));
+    }
+
+    const std::string read_line(tcp::socket& socket, boost::asio::streambuf& b) {
+        boost::asio::read_until(socket, b, "\n");
+        std::istream is(&b);
+        std::string line;
+        std::getline(is, line);
+        return line;
+    }
+
+    void fail(const std::string& what) {
+        std::cerr << "NG: " << what << "\n";
+        failed = true;
+    }
+
+    /**
+     * 1アカウント分の仮のサーバ. 相手の手は合法手のうち手数で決まるものを指す
+     */
+    void serve(tcp::socket socket) {
+        try {
+            boost::asio::streambuf b;
+            const std::string login = read_line(socket, b);
+            const std::string user = login.substr(6, login.find(' ', 6) - 6);
+            write_line(socket, "LOGIN:" + user + " OK");
+
+            if (user == "bad") {
+                // 初期局面で動かせない手を送る. tenukiが接続を切れば読み込みがeofで失敗する
+                write_line(socket, "BEGIN Game_Summary");
+                write_line(socket, "Your_Turn:-");
+                write_line(socket, "END Game_Summary");
+                read_line(socket, b); // AGREE
+                write_line(socket, "START:bad");
+                write_line(socket, "+5554FU,T1");
+                try {
+                    for (;;) {
+                        read_line(socket, b);
+                    }
+                } catch (const std::exception&) {
+                    dropped = true;
+                }
+                return;
+            }
+
+            for (int g = 0; g < GAMES; g++) {
+                const side_t engine = (g % 2 == 0) ? side::BLACK : side::WHITE;
+                write_line(socket, "BEGIN Game_Summary");
+                write_line(socket, "Protocol_Version:1.1");
+                write_line(socket, "Game_ID:" + user + "-" + std::to_string(g));
+                write_line(socket, std::string("Your_Turn:") + (engine == side::BLACK ? "+" : "-"));
+                write_line(socket, "To_Move:+");
+                write_line(socket, "END Game_Summary");
+                if (read_line(socket, b) != "AGREE") {
+                    fail(user + ": AGREE expected");
+                    return;
+                }
+                write_line(socket, "START:" + user + "-" + std::to_string(g));
+                auto sent = std::chrono::steady_clock::now(); // 最後に手番を渡した時刻
+                max_playing = std::max(max_playing.load(), ++playing);
+
+                position p = parse_position("lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1");
+                for (int ply = 0; ply < PLIES; ply++) {
+                    move_t moves[593];
+                    const int length = legal_moves(p, moves);
+                    std::string line;
+                    if (p.side_to_move == engine) {
+                        line = read_line(socket, b);
+                        const long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent).count();
+                        slowest = std::max(slowest.load(), elapsed);
+                        const move_t* it = std::find_if(&moves[0], &moves[length], [&](move_t m) { return to_string(m, p) == line; });
+                        if (it == &moves[length]) {
+                            fail(user + ": illegal move " + line);
+                            return;
+                        }
+                        p = do_move(p, *it);
+                    } else {
+                        const move_t m = moves[(ply * 7) % length];
+                        line = to_string(m, p);
+                        p = do_move(p, m);
+                    }
+                    write_line(socket, line + ",T1");
+                    sent = std::chrono::steady_clock::now();
+                }
+                playing--;
+                write_line(socket, "#MAX_MOVES");
+                write_line(socket, "#CENSORED");
+                finished++;
+            }
+
+            if (read_line(socket, b) != "LOGOUT") {
+                fail(user + ": LOGOUT expected");
+                return;
+            }
+            write_line(socket, "LOGOUT:completed");
+        } catch (const std::exception& e) {
+            fail(e.what());
+        }
+    }
+}
+
+int main() {
+
+    boost::asio::io_service io_service;
+    tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), 0));
+    const std::string port = std::to_string(acceptor.local_endpoint().port());
+
+    std::vector<std::thread> servers;
+    std::thread listener([&]() {
+        for (int i = 0; i < ACCOUNTS + 1; i++) { // 最後の1つは合法手でない手を送るアカウント
+            tcp::socket socket(io_service);
+            acceptor.accept(socket);
+            servers.emplace_back(serve, std::move(socket));
+        }
+    });
+
+    std::vector<std::pair<std::string, std::string>> accounts;
+    for (int i = 0; i < ACCOUNTS; i++) {
+        accounts.push_back(std::make_pair("user" + std::to_string(i), "pass"));
+    }
+    accounts.push_back(std::make_pair("bad", "pass"));
+    searcher s(1, 16);
+    const auto start = std::chrono::steady_clock::now();
+    run_multi("127.0.0.1", port, accounts, s, SECONDS, GAMES);
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    listener.join();
+    for (std::thread& t : servers) {
+        t.join();
+    }
+    if (failed || finished != ACCOUNTS * GAMES || max_playing < 2 || slowest > (SECONDS + MARGIN) * 1e6 || !dropped) {
+        std::cerr << "NG: " << finished << " games finished, " << max_playing << " at once, slowest reply " << slowest / 1e6 << " sec, " << (dropped ? "" : "not ") << "dropped\n";
+        return 1;
+    }
+    std::cerr << "OK: " << finished << " games, " << max_playing << " at once, slowest reply " << slowest / 1e6 << " sec, " << elapsed << " sec\n";
+    return 0;
+}
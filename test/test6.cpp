@@ -0,0 +1,73 @@
+#include "../tenuki.h"
+
+using namespace tenuki;
+
+/*
+ * 1手詰のテスト
+ * 適当に指し進めた局面でmate_in_oneが返した手が本当に詰みか（相手のどの手にも玉を取れるか）を全部の手を読んで確かめる.
+ */
+namespace {
+
+    bool is_mate(const position& p, move_t m) {
+        const side_t s = p.side_to_move;
+        const position q = do_move(p, m);
+        move_t moves[593];
+        const int length = legal_moves(q, moves);
+        for (int i = 0; i < length; i++) {
+            const position r = do_move(q, moves[i]);
+            if (r.king_address[s] == 0 || !is_attacked(r, r.king_address[side::opponent(s)], s)) {
+                return false; // 自玉を取られるか, 王手を外された
+            }
+        }
+        return length > 0;
+    }
+}
+
+int main() {
+
+    const std::vector<std::pair<std::string, std::string>> MATES {
+        {"4k4/9/4P4/9/9/9/9/9/4K4 b G 1", "+0052KI"},
+        {"4k4/9/9/9/9/9/4p4/9/4K4 w g 1", "-0058KI"},
+        {"7sk/8p/6G2/9/9/9/9/9/4K4 b N 1", "+0023KE"},
+    };
+    for (const auto& t : MATES) {
+        const position p = parse_position(t.first);
+        const move_t m = mate_in_one(p);
+        if (m == 0 || to_string(m, p) != t.second) {
+            std::cerr << "NG: " << t.first << " " << (m == 0 ? "none" : to_string(m, p)) << "\n";
+            return 1;
+        }
+    }
+
+    const std::vector<std::string> SFENS {
+        "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+        "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1",
+        "8l/1l+R2P3/p2pBG1pp/kps1p4/Nn1P2G2/P1P1P2PP/1PS6/1KSG3+r1/LN2+p3L w Sbgn3p 1",
+        "6n1l/2+S1k4/2lp4p/1np1B2b1/3PP4/1N1S3rP/1P2+pPP+p1/1p1G5/3KG2r1 b GSN2L4Pgs2p 1",
+    };
+    std::mt19937 gen(0);
+    int count = 0;
+    int found = 0;
+    for (int game = 0; game < 200; game++) {
+        position p = parse_position(SFENS[game % SFENS.size()]);
+        for (int ply = 0; ply < 200 && p.king_address[side::BLACK] != 0 && p.king_address[side::WHITE] != 0; ply++) {
+            move_t moves[593];
+            const int length = legal_moves(p, moves);
+            if (length == 0) {
+                break;
+            }
+            const move_t m = mate_in_one(p);
+            if (m != 0) {
+                if (std::find(&moves[0], &moves[length], m) == &moves[length] || !is_mate(p, m)) {
+                    std::cerr << "NG: " << to_string(m, p) << " " << to_sfen(p) << "\n";
+                    return 1;
+                }
+                found++;
+            }
+            count++;
+            p = do_move(p, moves[std::uniform_int_distribution<int>(0, length - 1)(gen)]);
+        }
+    }
+    std::cerr << "OK: " << found << " mates in " << count << " positions\n";
+    return 0;
+}
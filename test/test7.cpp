@@ -0,0 +1,69 @@
+#include "../tenuki.h"
+
+using namespace tenuki;
+
+/*
+ * do_moveの差分更新のテスト
+ * 適当に指し進めた局面ごとに, do_moveが差分で更新した利き・飛び利き・ハッシュ値・駒リスト・玉の位置が
+ * rebuildで一から作り直したものと同じか確かめる.
+ */
+namespace {
+
+    /**
+     * pがrebuildした局面と同じならtrueを返す. 駒リストは並び順が違ってよい
+     */
+    bool consistent(const position& p) {
+        position q = p;
+        rebuild(q);
+        if (std::memcmp(p.effect, q.effect, sizeof p.effect) != 0 || std::memcmp(p.long_effect, q.long_effect, sizeof p.long_effect) != 0) {
+            return false;
+        }
+        if (p.key != q.key || p.king_address[side::BLACK] != q.king_address[side::BLACK] || p.king_address[side::WHITE] != q.king_address[side::WHITE]) {
+            return false;
+        }
+        for (side_t s = side::BLACK; s <= side::WHITE; s++) {
+            if (p.piece_count[s] != q.piece_count[s]) {
+                return false;
+            }
+            for (int i = 0; i < p.piece_count[s]; i++) {
+                const int address = p.piece_list[s][i];
+                if (p.piece_index[address] != i || p.squares[address] == square::EMPTY || !square::is_friend(p.squares[address], s)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+int main() {
+
+    const std::vector<std::string> SFENS {
+        "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1",
+        "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1",
+        "8l/1l+R2P3/p2pBG1pp/kps1p4/Nn1P2G2/P1P1P2PP/1PS6/1KSG3+r1/LN2+p3L w Sbgn3p 1",
+        "6n1l/2+S1k4/2lp4p/1np1B2b1/3PP4/1N1S3rP/1P2+pPP+p1/1p1G5/3KG2r1 b GSN2L4Pgs2p 1",
+    };
+    std::mt19937 gen(0);
+    int count = 0;
+    for (int game = 0; game < 4000; game++) {
+        position p = parse_position(SFENS[game % SFENS.size()]);
+        for (int ply = 0; ply < 300 && p.king_address[side::BLACK] != 0 && p.king_address[side::WHITE] != 0; ply++) {
+            move_t moves[593];
+            const int length = legal_moves(p, moves);
+            if (length == 0) {
+                break;
+            }
+            const move_t m = moves[std::uniform_int_distribution<int>(0, length - 1)(gen)];
+            const position next = do_move(p, m);
+            if (!consistent(next)) {
+                std::cerr << "NG: " << to_string(m, p) << " " << to_sfen(p) << "\n";
+                return 1;
+            }
+            count++;
+            p = next;
+        }
+    }
+    std::cerr << "OK: " << count << " positions\n";
+    return 0;
+}